@@ -0,0 +1,11 @@
+; a heap that can be marked in parallel, though all of it hangs from the
+; spine of one list: 131072 short lists, kept alive while the garbage
+; churned out afterwards forces major collections. Compare the marking
+; lines --gc-stats prints on exit, or run bench/markheap.sh:
+;   kat --gc-threads 1 --gc-stats < bench/markheap.scm
+;   kat --gc-threads 4 --gc-stats < bench/markheap.scm
+; from the top of the tree, where it loads the helpers of the tests
+(load "tests/check.scm")
+(define (make-lists n acc) (if (= n 0) acc (make-lists (- n 1) (cons (make-list 8 '()) acc))))
+(define heap (make-lists 131072 '()))
+(junk 200000)
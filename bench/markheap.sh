@@ -0,0 +1,18 @@
+#!/bin/sh
+# marks the heap of markheap.scm with 1 to n threads (4 by default) and
+# prints the marking statistics of each run:
+#   bench/markheap.sh build/kat 8
+kat=${1:-./kat}
+n=${2:-4}
+# markheap.scm loads tests/check.scm, so it runs from the top of the tree
+case "$kat" in
+    /*) ;;
+    *) kat="$PWD/$kat" ;;
+esac
+cd "$(dirname "$0")/.." || exit 1
+threads=1
+while [ "$threads" -le "$n" ]; do
+    echo "--gc-threads $threads"
+    "$kat" --gc-threads "$threads" --gc-stats < bench/markheap.scm | grep -E '^(marked|the busiest)'
+    threads=$((threads * 2))
+done
@@ -1,13 +1,62 @@
 #include <iostream>
+#include <string>
+#include <stdexcept>
 #include "kvm.h"
 
+namespace
+{
+    int usage()
+    {
+        std::cerr << "usage: kat [--gc-pause <microseconds>] [--gc-threads <n>] [--gc-concurrent] [--gc-stats]\n";
+        return 1;
+    }
+
+    // the whole token as a number: std::stol alone stops at trailing junk
+    long parseLong(const std::string &token)
+    {
+        size_t end;
+        long value = std::stol(token, &end);
+        if (end != token.size())
+            throw std::invalid_argument(token);
+        return value;
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[])
 {
+    long gcPauseBudget = GC_PAUSE_BUDGET;
+    long gcMarkThreads = MARK_THREADS;
+    bool gcConcurrent = false;
+    bool gcStats = false;
+    try
+    {
+        for (int i = 1; i != argc; ++i)
+        {
+            std::string option = argv[i];
+            if (option == "--gc-pause" && i + 1 != argc)
+                gcPauseBudget = parseLong(argv[++i]);
+            else if (option == "--gc-threads" && i + 1 != argc)
+                gcMarkThreads = parseLong(argv[++i]);
+            else if (option == "--gc-concurrent")
+                gcConcurrent = true;
+            else if (option == "--gc-stats")
+                gcStats = true;
+            else
+                return usage();
+        }
+    } catch (const std::logic_error &)
+    {
+        // std::invalid_argument and std::out_of_range
+        return usage();
+    }
+    if (gcPauseBudget < 0 || gcMarkThreads < 1 || gcMarkThreads > MAX_MARK_THREADS)
+        return usage();
+
     std::cout << "Welcome to Kat v0.25. Use Ctrl+C to exit.\n";
     std::cin.unsetf(std::ios_base::skipws);
 
-    Kvm vm;
+    Kvm vm{gcPauseBudget, (unsigned int)gcMarkThreads, gcConcurrent, gcStats};
     return vm.repl(std::cin, std::cout);
 }
@@ -0,0 +1,127 @@
+#include "kbytes.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KAT_X86 1
+#endif
+
+namespace
+{
+    struct Kernels
+    {
+        void (*fill)(uint8_t *, uint8_t, size_t);
+        bool (*equal)(const uint8_t *, const uint8_t *, size_t);
+    };
+
+    void fillLibc(uint8_t *dst, uint8_t value, size_t n)
+    {
+        memset(dst, value, n);
+    }
+
+    bool equalLibc(const uint8_t *a, const uint8_t *b, size_t n)
+    {
+        return memcmp(a, b, n) == 0;
+    }
+
+#ifdef KAT_X86
+    /*
+     *  A range shorter than a vector is left to the C library. The last
+     *  vector of a longer range is done at n - width, and may overlap the
+     *  one before it.
+     */
+    __attribute__((target("sse2")))
+    void fillSse2(uint8_t *dst, uint8_t value, size_t n)
+    {
+        if (n < 16) return fillLibc(dst, value, n);
+        __m128i v = _mm_set1_epi8(static_cast<char>(value));
+        for (size_t i = 0; i + 16 <= n; i += 16)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n - 16), v);
+    }
+
+    __attribute__((target("sse2")))
+    bool sameSse2(const uint8_t *a, const uint8_t *b)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+    }
+
+    __attribute__((target("sse2")))
+    bool equalSse2(const uint8_t *a, const uint8_t *b, size_t n)
+    {
+        if (n < 16) return equalLibc(a, b, n);
+        for (size_t i = 0; i + 16 <= n; i += 16)
+            if (!sameSse2(a + i, b + i)) return false;
+        return sameSse2(a + n - 16, b + n - 16);
+    }
+
+    __attribute__((target("avx2")))
+    void fillAvx2(uint8_t *dst, uint8_t value, size_t n)
+    {
+        if (n < 32) return fillSse2(dst, value, n);
+        __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+        for (size_t i = 0; i + 32 <= n; i += 32)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n - 32), v);
+    }
+
+    __attribute__((target("avx2")))
+    __m256i diffAvx2(const uint8_t *a, const uint8_t *b)
+    {
+        return _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)),
+                                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+    }
+
+    // the differences of four vectors are or'ed and tested at once
+    __attribute__((target("avx2")))
+    bool equalAvx2(const uint8_t *a, const uint8_t *b, size_t n)
+    {
+        if (n < 32) return equalSse2(a, b, n);
+        size_t i = 0;
+        for (; i + 128 <= n; i += 128)
+        {
+            __m256i x = _mm256_or_si256(diffAvx2(a + i, b + i), diffAvx2(a + i + 32, b + i + 32));
+            __m256i y = _mm256_or_si256(diffAvx2(a + i + 64, b + i + 64), diffAvx2(a + i + 96, b + i + 96));
+            __m256i z = _mm256_or_si256(x, y);
+            if (!_mm256_testz_si256(z, z)) return false;
+        }
+        __m256i z = diffAvx2(a + n - 32, b + n - 32);
+        for (; i + 32 <= n; i += 32)
+            z = _mm256_or_si256(z, diffAvx2(a + i, b + i));
+        return _mm256_testz_si256(z, z);
+    }
+#endif
+
+    Kernels choose()
+    {
+#ifdef KAT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return {fillAvx2, equalAvx2};
+        if (__builtin_cpu_supports("sse2"))
+            return {fillSse2, equalSse2};
+#endif
+        return {fillLibc, equalLibc};
+    }
+
+    const Kernels kernels = choose();
+}
+
+void bytes::fill(uint8_t *dst, uint8_t value, size_t n)
+{
+    ::kernels.fill(dst, value, n);
+}
+
+// the C library already picks a copy for the cpu, and it beat the kernels
+// tried for it. The ranges may overlap.
+void bytes::copy(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    memmove(dst, src, n);
+}
+
+bool bytes::equal(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    return ::kernels.equal(a, b, n);
+}
@@ -0,0 +1,27 @@
+#ifndef KAT_BYTES_H_INCLUDED
+#define KAT_BYTES_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+///////////////////////////////////////////////////////////////////////////////
+/*
+ *  The bulk operations on the bytes of bytevectors. The fill and compare
+ *  kernels are chosen once, at startup, by what the cpu supports:
+ *
+ *      AVX2    32 bytes a step
+ *      SSE2    16 bytes a step, every x86-64 has it
+ *      other   the C library
+ */
+namespace bytes
+{
+    void fill(uint8_t *dst, uint8_t value, size_t n);
+
+    // the ranges may overlap, always the C library
+    void copy(uint8_t *dst, const uint8_t *src, size_t n);
+
+    // whether the n bytes of a and b are the same
+    bool equal(const uint8_t *a, const uint8_t *b, size_t n);
+}
+
+#endif
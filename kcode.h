@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+#ifndef KAT_KCODE_H
+#define KAT_KCODE_H
+
+#include <vector>
+#include <cstdint>
+#include "kvalue.h"
+
+///////////////////////////////////////////////////////////////////////////////
+/*
+ *  Every instruction is a single 32 bit word: the opcode lives in the low
+ *  8 bits and the operand in the remaining 24. Constants and symbols are
+ *  referred to by their index in the constant pool of the Code object.
+ *
+ *  CONST k                  push constants[k]
+ *  GLOBAL_REF k             push the value of the Binding constants[k]
+ *  GLOBAL_SET k             assign the top to the Binding constants[k]
+ *  GLOBAL_DEFINE k          define the Binding constants[k] with the top
+ *  LOCAL_REF d:s            push the value of slot s in the frame d levels up
+ *  LOCAL_SET d:s            assign the top to slot s in the frame d levels up
+ *  POP                      drop the top of the stack
+ *  JUMP t                   continue at t
+ *  JUMP_IF_FALSE t          pop a value, continue at t if it is #f
+ *  JUMP_IF_FALSE_OR_POP t   continue at t if the top is #f, else pop it
+ *  JUMP_IF_TRUE_OR_POP t    continue at t if the top is not #f, else pop it
+ *  CLOSURE k                push a procedure with code constants[k]
+ *  ENTER k                  pop the values of a let into a new frame laid out
+ *                           by constants[k], and make it the environment
+ *  LEAVE                    return to the environment enclosing the frame
+ *  CALL n                   call the procedure found below the n arguments
+ *  TAIL_CALL n              same as CALL, but reuse the current frame
+ *  RETURN                   return the top of the stack to the caller
+ *
+ *  Every expression leaves exactly one value on the stack. GLOBAL_SET,
+ *  GLOBAL_DEFINE and LOCAL_SET replace the value they assign with the symbol ok.
+ *
+ *  Variables bound by a lambda (its parameters followed by its internal
+ *  definitions) are resolved by the compiler to a lexical address: the
+ *  number of frames to skip and the slot inside that frame. Every other
+ *  variable belongs to the top level environment the code is compiled for,
+ *  and is resolved to its Binding in that environment.
+ */
+enum class Opcode : uint8_t
+{
+    CONST,
+    GLOBAL_REF,
+    GLOBAL_SET,
+    GLOBAL_DEFINE,
+    LOCAL_REF,
+    LOCAL_SET,
+    POP,
+    JUMP,
+    JUMP_IF_FALSE,
+    JUMP_IF_FALSE_OR_POP,
+    JUMP_IF_TRUE_OR_POP,
+    CLOSURE,
+    ENTER,
+    LEAVE,
+    CALL,
+    TAIL_CALL,
+    RETURN
+};
+
+#define MK_OP(op, arg) (static_cast<uint32_t>(op) | (static_cast<uint32_t>(arg) << 8))
+#define OP_CODE(ins) static_cast<Opcode>((ins) & 0xff)
+#define OP_ARG(ins) ((ins) >> 8)
+#define MAX_OP_ARG 0xffffff
+
+#define MK_LEXICAL(depth, slot) (((depth) << 12) | (slot))
+#define LEXICAL_DEPTH(arg) ((arg) >> 12)
+#define LEXICAL_SLOT(arg) ((arg) & 0xfff)
+#define MAX_LEXICAL 0xfff
+
+//---------------------------------------------------------------------------
+// The variables of the lambdas enclosing the expression being compiled.
+// The outermost scope stands for the top level environment and has no
+// variables of its own.
+struct Scope
+{
+    explicit Scope(const Scope *parent) : parent(parent), environment(parent->environment) {}
+    explicit Scope(const Value *environment) : parent(nullptr), environment(environment) {}
+
+    bool isTopLevel() const { return parent == nullptr; }
+
+    const Scope *parent;
+    const Value *environment;
+    std::vector<const Value *> variables;
+};
+
+//---------------------------------------------------------------------------
+// The compiled body of a lambda (or of a top level expression).
+class Code final : public Value
+{
+public:
+    Code() : Value(ValueType::CODE) {}
+
+    void clear()
+    {
+        variables_ = nullptr;
+        numParameters_ = 0;
+        numVariables_ = 0;
+        rest_ = false;
+        instructions_.clear();
+        constants_.clear();
+    }
+private:
+    const Value *variables_ = nullptr;   // the names of the frame slots
+    size_t numParameters_ = 0;
+    size_t numVariables_ = 0;
+    bool rest_ = false;                  // the last parameter holds a list of the extra arguments
+    std::vector<uint32_t> instructions_;
+    std::vector<const Value *> constants_;
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+#endif //KAT_KCODE_H
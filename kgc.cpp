@@ -1,159 +1,1342 @@
 #include "kgc.h"
+#include "kcode.h"
+#include "ksymbol.h"
 #include <cassert>
+#include <cstring>
 #include <algorithm>
+#include <new>
+#include <chrono>
 #include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/mman.h>
+
+namespace
+{
+    // the car of a nursery pair that was copied; the cdr is the copy
+    const Value forwardedPair{ValueType::MAX};
+
+    // the slot size of every size class
+    const size_t sizeClasses[NUM_SIZE_CLASSES] = {16, 16, 32, 48, 64, 80, 96, 128, 192, 256};
+
+    // the smallest class an object with a header fits in
+    size_t sizeClassOf(size_t bytes)
+    {
+        for (size_t c = PAIR_CLASS + 1; c != NUM_SIZE_CLASSES; ++c)
+        {
+            if (bytes <= sizeClasses[c]) return c;
+        }
+        return LARGE_CLASS;
+    }
+
+    size_t frameBytes(size_t size)
+    {
+        return sizeof(Frame) + (std::max<size_t>(size, 1) - 1) * sizeof(const Value *);
+    }
+
+    size_t vectorBytes(size_t size)
+    {
+        return sizeof(Vector) + (std::max<size_t>(size, 1) - 1) * sizeof(const Value *);
+    }
+
+    size_t bytevectorBytes(size_t size)
+    {
+        return sizeof(Bytevector) + std::max<size_t>(size, sizeof(const Value *)) - sizeof(const Value *);
+    }
+
+    Page* pageOf(const void *object)
+    {
+        return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(object) & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+    }
+
+    // the word and the bit of a slot in the bitmaps of its page
+    void slotBit(Page *page, const void *slot, size_t &word, uint64_t &bit)
+    {
+        size_t index = (static_cast<const char *>(slot) - page->slots()) / page->objectSize;
+        word = index / 64;
+        bit = uint64_t(1) << (index % 64);
+    }
+
+    // a procedure drops its tag, the other objects that are not pairs have none
+    const Value* untag(const Value *v)
+    {
+        return TK_PROC(v);
+    }
+
+    // the mark bitmap word of a heap object, pair or procedure
+    uint64_t* markWord(const Value *v, uint64_t &bit)
+    {
+        const void *object = reinterpret_cast<const void *>(reinterpret_cast<uintptr_t>(v) & PTR_MASK);
+        size_t word;
+        Page *page = pageOf(object);
+        slotBit(page, object, word, bit);
+        return &page->marks[word];
+    }
+
+    // maps bytes aligned to GC_PAGE_SIZE
+    void* mapPages(size_t bytes)
+    {
+        size_t mapped = bytes + GC_PAGE_SIZE;
+        void *memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        auto start = reinterpret_cast<uintptr_t>(memory);
+        auto aligned = (start + GC_PAGE_SIZE - 1) & ~(uintptr_t)(GC_PAGE_SIZE - 1);
+        if (aligned != start)
+        {
+            munmap(memory, aligned - start);
+        }
+        if (start + mapped != aligned + bytes)
+        {
+            munmap(reinterpret_cast<void *>(aligned + bytes), start + mapped - aligned - bytes);
+        }
+        return reinterpret_cast<void *>(aligned);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A thread of a parallel mark
+struct MarkWorker
+{
+    const Kgc *gc = nullptr;
+    std::vector<const Value *> grey;
+    std::mutex lock;
+    std::deque<const Value *> shared;       // guarded by lock
+    std::atomic<size_t> numShared{0};
+    unsigned long marked = 0;
+    unsigned long steals = 0;
+
+    // a concurrent marker also shares with the vm thread, under lock
+    bool concurrent = false;                // the marker thread of a concurrent mark
+    std::vector<const Value *> deferred;    // environments and code, for the vm to scan
+    std::condition_variable wake;
+    bool idle = false;
+    bool stop = false;
+
+    // leaves the objects the vm may be growing to the vm thread
+    bool defer(const Value *v)
+    {
+        if (!concurrent || (v->type() != ValueType::ENVIRONMENT && v->type() != ValueType::CODE &&
+                            v->type() != ValueType::HASH_TABLE))
+            return false;
+        std::lock_guard<std::mutex> guard{lock};
+        deferred.push_back(v);
+        return true;
+    }
+
+    bool setMark(const Value *v)
+    {
+        if (!v || IS_IMMEDIATE(v) || gc->isYoung(v)) return false;
+        uint64_t bit;
+        uint64_t *word = markWord(v, bit);
+        if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return false;
+        ++marked;
+        return true;
+    }
+
+    void mark(const Value *v)
+    {
+        if (setMark(v))
+        {
+            grey.push_back(v);
+        }
+    }
+
+    // the rest of a long list goes where a thief can take it
+    void pushTail(const Value *v)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        shared.push_back(v);
+        numShared = shared.size();
+    }
+
+    // hands the older half of the private stack over to the thieves
+    void share()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        auto half = grey.size() / 2;
+        shared.insert(shared.end(), grey.begin(), grey.begin() + half);
+        grey.erase(grey.begin(), grey.begin() + half);
+        numShared = shared.size();
+    }
+
+    // takes what another worker shared, half of it, or all of its own
+    bool take(MarkWorker &victim)
+    {
+        if (victim.numShared == 0) return false;
+        std::lock_guard<std::mutex> guard{victim.lock};
+        auto &from = victim.shared;
+        if (from.empty()) return false;
+        auto n = &victim == this ? from.size() : (from.size() + 1) / 2;
+        grey.insert(grey.end(), from.begin(), from.begin() + n);
+        from.erase(from.begin(), from.begin() + n);
+        victim.numShared = from.size();
+        return true;
+    }
+};
+
+Kgc::Kgc(unsigned int maxObjects, long pauseBudget, unsigned int markThreads, bool concurrent, bool stats)
+: numObjects_(0), maxObjects_(maxObjects), markThreads_(std::max(markThreads, 1u)), concurrent_(concurrent),
+  pauseBudget_(pauseBudget), stats_(stats)
+{
+    nursery_ = new char[NURSERY_SIZE];
+    nurseryTop_ = nursery_;
+}
 
 Value* Kgc::allocValue(ValueType type)
 {
-    if (numObjects_ >= maxObjects_)
+    assert(type != ValueType::CELL);
+    totalObjects_[(int)type]++;
+    paceMarking();
+    if (type == ValueType::COMP_PROC)
     {
-        collect();
+        if (void *p = allocYoung(sizeof(CompoundProc))) return new (p) CompoundProc;
+    }
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    Value *v = allocOld(type);
+    if (type == ValueType::COMP_PROC)
+    {
+        // its fields are about to be set without a write barrier
+        remember(v);
     }
-    
-    Value *v = allocSpecial(type);
-    v->next_ = firstObject_;
-    firstObject_ = v;
-    ++numObjects_;
-    totalObjects_[(int)type]++;;
     return v;
 }
 
+Cell* Kgc::allocCell()
+{
+    totalObjects_[(int)ValueType::CELL]++;
+    paceMarking();
+    if (void *p = allocYoung(sizeof(Cell))) return static_cast<Cell *>(p);
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    Cell *c = static_cast<Cell *>(allocSlot(PAIR_CLASS));
+    remember(MK_PAIR(c));
+    return c;
+}
+
+Frame* Kgc::allocFrame(size_t size)
+{
+    totalObjects_[(int)ValueType::FRAME]++;
+    paceMarking();
+    if (void *p = allocYoung(frameBytes(size)))
+    {
+        Frame *frame = new (p) Frame;
+        frame->size_ = size;
+        return frame;
+    }
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    Frame *frame = allocOldFrame(size);
+    remember(frame);
+    return frame;
+}
+
+// a vector too big for the size classes is allocated old
+Vector* Kgc::allocVector(size_t size)
+{
+    totalObjects_[(int)ValueType::VECTOR]++;
+    paceMarking();
+    auto bytes = vectorBytes(size);
+    if (sizeClassOf(bytes) != LARGE_CLASS)
+    {
+        if (void *p = allocYoung(bytes))
+        {
+            Vector *vector = new (p) Vector;
+            vector->size_ = size;
+            return vector;
+        }
+    }
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    Vector *vector = allocOldVector(size);
+    remember(vector);
+    return vector;
+}
+
+// holds no pointers, so an old one needs no remembering
+Bytevector* Kgc::allocBytevector(size_t size)
+{
+    totalObjects_[(int)ValueType::BYTEVECTOR]++;
+    paceMarking();
+    auto bytes = bytevectorBytes(size);
+    if (sizeClassOf(bytes) != LARGE_CLASS)
+    {
+        if (void *p = allocYoung(bytes))
+        {
+            Bytevector *bytevector = new (p) Bytevector;
+            bytevector->size_ = size;
+            return bytevector;
+        }
+    }
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    return allocOldBytevector(size);
+}
+
+// only a string with its chars inline goes to the nursery
+String* Kgc::allocString(size_t size)
+{
+    totalObjects_[(int)ValueType::STRING]++;
+    paceMarking();
+    if (size <= STRING_INLINE_CHARS)
+    {
+        if (void *p = allocYoung(sizeof(String)))
+        {
+            String *string = new (p) String;
+            string->size_ = size;
+            return string;
+        }
+    }
+
+    if (heapFull())
+    {
+        collectionPending_ = true;
+    }
+    return allocOldString(size);
+}
+
+String* Kgc::allocOldString(size_t size)
+{
+    String *string = new (allocSlot(sizeClassOf(sizeof(String)))) String;
+    if (size > STRING_INLINE_CHARS)
+    {
+        string->heap_ = new char[size + 1];
+        allocatedBytes_ += size + 1;
+    }
+    string->size_ = size;
+    return string;
+}
+
+Value* Kgc::allocOld(ValueType type)
+{
+    switch (type)
+    {
+        case ValueType::COMP_PROC:
+            return new (allocSlot(sizeClassOf(sizeof(CompoundProc)))) CompoundProc;
+        case ValueType::INPUT_PORT:
+            return new (allocSlot(sizeClassOf(sizeof(InputPort)))) InputPort;
+        case ValueType::OUTPUT_PORT:
+            return new (allocSlot(sizeClassOf(sizeof(OutputPort)))) OutputPort;
+        case ValueType::PRIM_PROC:
+            return new (allocSlot(sizeClassOf(sizeof(PrimitiveProc)))) PrimitiveProc;
+        case ValueType::SYMBOL:
+            return new (allocSlot(sizeClassOf(sizeof(Symbol)))) Symbol;
+        case ValueType::CODE:
+            return new (allocSlot(sizeClassOf(sizeof(Code)))) Code;
+        case ValueType::ENVIRONMENT:
+            return new (allocSlot(sizeClassOf(sizeof(Environment)))) Environment;
+        case ValueType::BINDING:
+            return new (allocSlot(sizeClassOf(sizeof(Binding)))) Binding;
+        case ValueType::HASH_TABLE:
+            return new (allocSlot(sizeClassOf(sizeof(HashTable)))) HashTable;
+        default:
+            assert(false);
+            return nullptr;
+    }
+}
+
+Frame* Kgc::allocOldFrame(size_t size)
+{
+    auto bytes = frameBytes(size);
+    auto sizeClass = sizeClassOf(bytes);
+    Frame *frame = new (sizeClass == LARGE_CLASS ? allocLarge(bytes) : allocSlot(sizeClass)) Frame;
+    frame->size_ = size;
+    return frame;
+}
+
+Vector* Kgc::allocOldVector(size_t size)
+{
+    auto bytes = vectorBytes(size);
+    auto sizeClass = sizeClassOf(bytes);
+    Vector *vector = new (sizeClass == LARGE_CLASS ? allocLarge(bytes) : allocSlot(sizeClass)) Vector;
+    vector->size_ = size;
+    return vector;
+}
+
+Bytevector* Kgc::allocOldBytevector(size_t size)
+{
+    auto bytes = bytevectorBytes(size);
+    auto sizeClass = sizeClassOf(bytes);
+    Bytevector *bytevector = new (sizeClass == LARGE_CLASS ? allocLarge(bytes) : allocSlot(sizeClass)) Bytevector;
+    bytevector->size_ = size;
+    return bytevector;
+}
+
+// free slots are linked through their first word
+void* Kgc::allocSlot(size_t sizeClass)
+{
+    assert(sizeClass != LARGE_CLASS);
+    if (!freeSlots_[sizeClass])
+    {
+        refill(sizeClass);
+    }
+    void *slot = freeSlots_[sizeClass];
+    freeSlots_[sizeClass] = *static_cast<void **>(slot);
+
+    size_t word;
+    uint64_t bit;
+    Page *page = pageOf(slot);
+    slotBit(page, slot, word, bit);
+    page->live[word] |= bit;
+    ++numObjects_;
+    if (marking_)
+    {
+        // grey when incremental, black for a snapshot
+        const Value *v = sizeClass == PAIR_CLASS ? MK_PAIR(static_cast<Cell *>(slot)) : static_cast<const Value *>(slot);
+        if (concurrent_)
+            setMark(v);
+        else
+            mark(v);
+    }
+    return slot;
+}
+
+// an object too big for the size classes gets a page of its own
+void* Kgc::allocLarge(size_t bytes)
+{
+    auto mappedSize = (sizeof(Page) + 15 + bytes + GC_PAGE_SIZE - 1) & ~size_t(GC_PAGE_SIZE - 1);
+    Page *page = static_cast<Page *>(mapPages(mappedSize));
+    page->sizeClass = LARGE_CLASS;
+    page->objectSize = bytes;
+    page->numSlots = 1;
+    page->mappedSize = mappedSize;
+    page->live[0] = 1;
+    largePages_.push_back(page);
+    largeBytes_ += mappedSize;
+    allocatedBytes_ += mappedSize;
+    ++numObjects_;
+    if (marking_)
+    {
+        if (concurrent_)
+            setMark(reinterpret_cast<const Value *>(page->slots()));
+        else
+            mark(reinterpret_cast<const Value *>(page->slots()));
+    }
+    return page->slots();
+}
+
+void Kgc::addPage(size_t sizeClass)
+{
+    Page *page = nullptr;
+    if (!emptyPages_.empty())
+    {
+        page = emptyPages_.back();
+        emptyPages_.pop_back();
+    } else
+    {
+        page = static_cast<Page *>(mapPages(GC_PAGE_SIZE));
+    }
+    memset(page, 0, sizeof(Page));
+    page->sizeClass = sizeClass;
+    page->objectSize = sizeClasses[sizeClass];
+    page->numSlots = std::min<size_t>((GC_PAGE_SIZE - (page->slots() - reinterpret_cast<char *>(page))) / page->objectSize,
+                                      GC_PAGE_WORDS * 64);
+    page->mappedSize = GC_PAGE_SIZE;
+
+    for (size_t i = page->numSlots; i != 0; --i)
+    {
+        void *slot = page->slots() + (i - 1) * page->objectSize;
+        *static_cast<void **>(slot) = freeSlots_[sizeClass];
+        freeSlots_[sizeClass] = slot;
+    }
+    pages_[sizeClass].push_back(page);
+    sweepCursor_[sizeClass] = pages_[sizeClass].size();
+}
+
+// sweeps pages of the size class until one has a free slot, or adds a page
+void Kgc::refill(size_t sizeClass)
+{
+    while (sweepCursor_[sizeClass] != pages_[sizeClass].size())
+    {
+        sweepNext(sizeClass);
+        if (freeSlots_[sizeClass]) return;
+    }
+    addPage(sizeClass);
+}
+
+// gives the memory of an empty page back to the os, but not its addresses
+void Kgc::releasePage(Page *page)
+{
+    if (page->sizeClass == LARGE_CLASS)
+    {
+        largeBytes_ -= page->mappedSize;
+        munmap(page, page->mappedSize);
+        return;
+    }
+    madvise(page, GC_PAGE_SIZE, MADV_DONTNEED);
+    emptyPages_.push_back(page);
+}
+
+void* Kgc::allocYoung(size_t bytes)
+{
+    bytes = (bytes + TAG_MASK) & PTR_MASK;
+    if (bytes > static_cast<size_t>(nursery_ + NURSERY_SIZE - nurseryTop_))
+    {
+        collectionPending_ = true;
+        nurseryFull_ = true;
+        return nullptr;
+    }
+    void *p = nurseryTop_;
+    nurseryTop_ += bytes;
+    return p;
+}
+
 Kgc::~Kgc()
 {
-    assert(localStackRoots_.empty());
+    assert(!shadowStack_);
 #ifndef NDEBUG
     printf("statistics:\n");
     for (int i = 0; i != (int)ValueType::MAX; ++i)
         printf("totalObjects[%d] = %u\n", i, totalObjects_[i]);
-    printf("reserved:\n");
-    for (int i = 0; i != (int)ValueType::MAX; ++i)
-        printf("%d => %zu\n", i, reserved[i].size());
+    printf("pages:\n");
+    for (int i = 0; i != NUM_SIZE_CLASSES; ++i)
+        printf("%zu => %zu\n", sizeClasses[i], pages_[i].size());
+    printf("large => %zu, empty => %zu\n", largePages_.size(), emptyPages_.size());
 #endif
     stackRoots_.clear();
-    collect();
-    for (auto &&vec : reserved)
+    if (marking_ && concurrent_)
+        serviceConcurrentMark(true);
+    minorCollect();
+    if (marking_)
+        finishMark();
+    else
+        majorCollect();
+    finishSweep();
+    // the marker has been joined, and the last collection counts too
+    if (stats_)
+    {
+        auto markNs = std::chrono::duration_cast<std::chrono::nanoseconds>(markTime_).count();
+        printf("marked %lu objects in %lld us (%.1f ns/object, %u threads, %lu steals)\n", markedObjects_,
+               (long long)markNs / 1000, markedObjects_ ? (double)markNs / markedObjects_ : 0.0, markThreads_,
+               steals_);
+        if (parallelMarked_)
+            printf("the busiest thread marked %.1f%% of what was traced in parallel\n",
+                   100.0 * busiestMarked_ / parallelMarked_);
+        auto pauseUs = std::chrono::duration_cast<std::chrono::microseconds>(pauseTime_).count();
+        printf("%lu pauses in %lld us, mean %.1f us, max %lld us, max marking %lld us (budget = %lld us)\n",
+               numPauses_, (long long)pauseUs, numPauses_ ? (double)pauseUs / numPauses_ : 0.0,
+               (long long)std::chrono::duration_cast<std::chrono::microseconds>(maxPause_).count(),
+               (long long)std::chrono::duration_cast<std::chrono::microseconds>(maxMarkPause_).count(),
+               (long long)pauseBudget_.count());
+        printf("%lu remarks, %lu marks finished past the budget\n", numRemarks_, forcedFinishes_);
+    }
+    for (size_t c = PAIR_CLASS + 1; c != NUM_SIZE_CLASSES; ++c)
     {
-        for (auto v : vec)
-            delete v;
-        vec.clear();
+        for (auto page : pages_[c])
+        {
+            for (size_t i = 0; i != page->numSlots; ++i)
+            {
+                if (page->live[i / 64] & (uint64_t(1) << (i % 64)))
+                    destroy(reinterpret_cast<Value *>(page->slots() + i * page->objectSize));
+            }
+        }
     }
+    for (auto &&pages : pages_)
+    {
+        for (auto page : pages)
+            munmap(page, GC_PAGE_SIZE);
+    }
+    for (auto page : emptyPages_)
+        munmap(page, GC_PAGE_SIZE);
+    for (auto page : largePages_)
+        munmap(page, page->mappedSize);
+    delete [] nursery_;
 }
 
 void Kgc::collect()
 {
-    auto numObjects = numObjects_;
-    auto maxObjects = maxObjects_;
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    collectionPending_ = false;
+    if (nurseryFull_ || !marking_)
+    {
+        nurseryFull_ = false;
+        minorCollect();
+    }
+    auto markStart = steady_clock::now();
+    if (marking_ && concurrent_)
+    {
+        serviceConcurrentMark(false);
+    } else if (marking_ && allocatedBytes_ >= 2 * maxAllocatedBytes_)
+    {
+        // the objects allocated grey outgrow what the slices trace
+        ++forcedFinishes_;
+        finishMark();
+    } else if (marking_)
+    {
+        markSlice(start + pauseBudget_);
+    } else if (heapFull())
+    {
+        if (concurrent_)
+        {
+            startConcurrentMark();
+        } else if (pauseBudget_.count() == 0)
+        {
+            majorCollect();
+        } else
+        {
+            startMark();
+            markSlice(start + pauseBudget_);
+        }
+    }
+
+    auto end = steady_clock::now();
+    ++numPauses_;
+    pauseTime_ += end - start;
+    maxPause_ = std::max(maxPause_, end - start);
+    maxMarkPause_ = std::max(maxMarkPause_, end - markStart);
+}
+
+// mark & sweep of the old space in a single pause. The nursery must be empty.
+void Kgc::majorCollect()
+{
+    startMark();
+    auto start = std::chrono::steady_clock::now();
+    traceMarkStack();
+    markTime_ += std::chrono::steady_clock::now() - start;
+    finishMark();
+}
+
+// shades the roots. The nursery must be empty.
+void Kgc::startMark()
+{
+    auto start = std::chrono::steady_clock::now();
+    finishSweep();
+    marking_ = true;
+    sliceAllocations_ = 0;
+    numObjectsAtMark_ = numObjects_;
+    markedAtMark_ = markedObjects_;
+    markTimeAtMark_ = markTime_;
+    remarks_ = 0;
     markAll();
-    sweep();
-    maxObjects_ = std::max(numObjects_ * 2, (unsigned int)INITIAL_GC_THRESHOLD);
+    markTime_ += std::chrono::steady_clock::now() - start;
+}
+
+// scans grey objects until the deadline, and remarks once there are none
+void Kgc::markSlice(std::chrono::steady_clock::time_point deadline)
+{
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    auto now = start;
+    while (now < deadline)
+    {
+        if (markStack_.empty())
+        {
+            if (remarks_ == MAX_REMARKS)
+                break;
+            ++remarks_;
+            ++numRemarks_;
+            minorCollect();
+            markAll();
+            if (markStack_.empty())
+            {
+                markTime_ += steady_clock::now() - start;
+                endMark();
+                return;
+            }
+        }
+        for (int i = 0; i != 16 && !markStack_.empty(); ++i)
+        {
+            const Value *v = markStack_.back();
+            markStack_.pop_back();
+            scan(v, *this);
+        }
+        now = steady_clock::now();
+    }
+    markTime_ += now - start;
+    if (markStack_.empty() && remarks_ == MAX_REMARKS)
+    {
+        ++forcedFinishes_;
+        finishMark();
+    }
+}
+
+// the last pause of a mark, with no deadline
+void Kgc::finishMark()
+{
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    minorCollect();
+    markAll();
+    traceMarkStack();
+    markTime_ += steady_clock::now() - start;
+    endMark();
+}
+
+void Kgc::endMark()
+{
+    using namespace std::chrono;
+
+    marking_ = false;
+
+    pruneWeakTables();
+
+    // the dead are freed as the pages get swept, the marked are what is left
+    numObjects_ = markedObjects_ - markedAtMark_;
+    sweepLarge();
+    size_t heapBytes = largeBytes_;
+    for (size_t c = 0; c != NUM_SIZE_CLASSES; ++c)
+    {
+        heapBytes += pages_[c].size() * GC_PAGE_SIZE;
+        freeSlots_[c] = nullptr;
+        sweepCursor_[c] = 0;
+        for (auto page : pages_[c])
+            page->unswept = true;
+    }
 #ifndef NDEBUG
-    printf("Collected %u objects, %u remaining (max = %u)\n", numObjects - numObjects_, numObjects_, maxObjects);
+    printf("Collected %u objects, %u remaining (max = %u), marked %lu in %lld us\n",
+           numObjectsAtMark_ - std::min(numObjectsAtMark_, numObjects_), numObjects_, maxObjects_,
+           markedObjects_ - markedAtMark_, (long long)duration_cast<microseconds>(markTime_ - markTimeAtMark_).count());
 #endif
+    maxObjects_ = std::max(numObjects_ * 2, (unsigned int)INITIAL_GC_THRESHOLD);
+    allocatedBytes_ = 0;
+    maxAllocatedBytes_ = std::max(heapBytes, (size_t)INITIAL_GC_BYTES);
 }
 
-void Kgc::mark(const Value *v)
+// the handshake that starts a concurrent mark
+void Kgc::startConcurrentMark()
+{
+    startMark();
+    marker_.reset(new MarkWorker);
+    marker_->gc = this;
+    marker_->concurrent = true;
+    marker_->grey.swap(markStack_);
+    markerThread_ = std::thread{[this] { traceConcurrently(); }};
+}
+
+// trades grey objects with the marker, and ends the mark when both are done
+void Kgc::serviceConcurrentMark(bool wait)
 {
-    if (IS_INT(v) || IS_CHR(v)) return;
-    if (v->marked_) return;
-    
-    v->marked_ = 1;
-    if (v->type() == ValueType::CELL)
+    while (true)
     {
-        const Cell *c = static_cast<const Cell *>(v);
-        mark(c->head_);
-        mark(c->tail_);
-    } else if (v->type() == ValueType::COMP_PROC)
+        std::vector<const Value *> deferred;
+        {
+            std::lock_guard<std::mutex> guard{marker_->lock};
+            deferred.swap(marker_->deferred);
+        }
+        for (auto v : deferred)
+            scan(v, *this);
+
+        std::unique_lock<std::mutex> lock{marker_->lock};
+        if (!markStack_.empty())
+        {
+            marker_->shared.insert(marker_->shared.end(), markStack_.begin(), markStack_.end());
+            marker_->numShared = marker_->shared.size();
+            markStack_.clear();
+            marker_->wake.notify_one();
+        } else if (deferred.empty() && marker_->idle && marker_->shared.empty() && marker_->deferred.empty())
+        {
+            marker_->stop = true;
+            marker_->wake.notify_one();
+            lock.unlock();
+            markerThread_.join();
+            markedObjects_ += marker_->marked;
+            marker_.reset();
+            endMark();
+            return;
+        }
+        lock.unlock();
+        if (!wait) return;
+        std::this_thread::yield();
+    }
+}
+
+// the marker thread
+void Kgc::traceConcurrently()
+{
+    // only the time spent tracing counts, not the waits
+    auto start = std::chrono::steady_clock::now();
+    MarkWorker &me = *marker_;
+    while (true)
     {
-        const CompoundProc *cp = static_cast<const CompoundProc *>(v);
-        mark(cp->parameters_);
-        mark(cp->body_);
-        mark(cp->env_);
+        while (!me.grey.empty())
+        {
+            const Value *v = me.grey.back();
+            me.grey.pop_back();
+            scan(v, me);
+        }
+        if (me.take(me)) continue;
+
+        std::unique_lock<std::mutex> lock{me.lock};
+        me.idle = true;
+        markTime_ += std::chrono::steady_clock::now() - start;
+        me.wake.wait(lock, [&me] { return !me.shared.empty() || me.stop; });
+        if (me.stop) return;
+        me.idle = false;
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+void Kgc::pruneWeakTables()
+{
+    for (auto table : weakTables_)
+    {
+        for (auto iter = table->begin(); iter != table->end();)
+        {
+            uint64_t bit;
+            if (*markWord(iter->second, bit) & bit)
+                ++iter;
+            else
+                iter = table->erase(iter);
+        }
+    }
+    if (symbolTable_)
+    {
+        symbolTable_->prune([this](const Symbol *s) {
+            uint64_t bit;
+            return (*markWord(s, bit) & bit) != 0;
+        });
+    }
+}
+
+// asks for a marking slice every MARK_SLICE_ALLOCATIONS allocations
+void Kgc::paceMarking()
+{
+    if (marking_ && ++sliceAllocations_ == MARK_SLICE_ALLOCATIONS)
+    {
+        sliceAllocations_ = 0;
+        collectionPending_ = true;
     }
 }
 
-void Kgc::sweep()
+///////////////////////////////////////////////////////////////////////////////
+// promotes the live nursery objects, breadth first through promoted_
+void Kgc::minorCollect()
 {
-    const Value **object = &firstObject_;
-    while (*object)
+    for (auto frame = shadowStack_; frame; frame = frame->prev)
+    {
+        for (size_t i = 0; i != frame->size; ++i)
+            *frame->roots[i] = evacuate(*frame->roots[i]);
+    }
+    for (auto stack : rootStacks_)
     {
-        if (!(*object)->marked_)
+        for (auto &&v : *stack)
+            v = evacuate(v);
+    }
+    for (auto v : remembered_)
+    {
+        if (IS_PAIR(v))
         {
-            const Value *unreached = *object;
-            *object = unreached->next_;
-            dealloc(unreached);
+            size_t word;
+            uint64_t bit;
+            Page *page = pageOf(TK_PAIR(v));
+            slotBit(page, TK_PAIR(v), word, bit);
+            page->remembered[word] &= ~bit;
         } else
         {
-            (*object)->marked_ = 0;
-            object = (const Value **)&(*object)->next_;
+            v->gcFlags_ &= ~GC_REMEMBERED;
         }
+        scavenge(v);
+    }
+    remembered_.clear();
+
+    for (size_t i = 0; i != promoted_.size(); ++i)
+    {
+        scavenge(promoted_[i]);
     }
+    promoted_.clear();
+    nurseryTop_ = nursery_;
+    ++epoch_;
 }
 
-void Kgc::markAll()
+// the old space copy of v, which keeps its address in its first field
+const Value* Kgc::evacuate(const Value *v)
 {
-    for (auto v : localStackRoots_)
+    if (!isYoung(v)) return v;
+
+    const Value *copy = nullptr;
+    if (IS_PAIR(v))
     {
-        if (*v)
+        Cell *from = TK_PAIR(v);
+        if (from->head_ == &forwardedPair) return from->tail_;
+
+        Cell *to = static_cast<Cell *>(allocSlot(PAIR_CLASS));
+        to->head_ = from->head_;
+        to->tail_ = from->tail_;
+        copy = MK_PAIR(to);
+        from->head_ = &forwardedPair;
+        from->tail_ = copy;
+    } else if (IS_PROC(v))
+    {
+        // the primitives are never young
+        CompoundProc *from = static_cast<CompoundProc *>(TK_PROC(v));
+        if (from->gcFlags_ & GC_FORWARDED) return from->code_;
+
+        CompoundProc *to = static_cast<CompoundProc *>(allocOld(ValueType::COMP_PROC));
+        to->code_ = from->code_;
+        to->env_ = from->env_;
+        copy = MK_PROC(to);
+        from->gcFlags_ |= GC_FORWARDED;
+        from->code_ = copy;
+    } else if (v->type() == ValueType::VECTOR)
+    {
+        // forwarded through the first element, there is one even when empty
+        Vector *from = const_cast<Vector *>(static_cast<const Vector *>(v));
+        if (from->gcFlags_ & GC_FORWARDED) return from->elements_[0];
+
+        Vector *to = allocOldVector(from->size_);
+        std::copy(from->elements_, from->elements_ + from->size_, to->elements_);
+        copy = to;
+        from->gcFlags_ |= GC_FORWARDED;
+        from->elements_[0] = copy;
+    } else if (v->type() == ValueType::STRING)
+    {
+        // a young string has its chars inline, the first of them forward it
+        String *from = const_cast<String *>(static_cast<const String *>(v));
+        if (from->gcFlags_ & GC_FORWARDED)
+        {
+            memcpy(&copy, from->inline_, sizeof copy);
+            return copy;
+        }
+
+        String *to = allocOldString(from->size_);
+        memcpy(to->inline_, from->inline_, sizeof from->inline_);
+        copy = to;
+        from->gcFlags_ |= GC_FORWARDED;
+        memcpy(from->inline_, &copy, sizeof copy);
+    } else if (v->type() == ValueType::BYTEVECTOR)
+    {
+        // forwarded through the first bytes, there is room for a pointer
+        Bytevector *from = const_cast<Bytevector *>(static_cast<const Bytevector *>(v));
+        if (from->gcFlags_ & GC_FORWARDED)
         {
-            mark(*v);
+            memcpy(&copy, from->bytes_, sizeof copy);
+            return copy;
         }
+
+        Bytevector *to = allocOldBytevector(from->size_);
+        memcpy(to->bytes_, from->bytes_, from->size_);
+        copy = to;
+        from->gcFlags_ |= GC_FORWARDED;
+        memcpy(from->bytes_, &copy, sizeof copy);
+    } else
+    {
+        assert(v->type() == ValueType::FRAME);
+        Frame *from = const_cast<Frame *>(static_cast<const Frame *>(v));
+        if (from->gcFlags_ & GC_FORWARDED) return from->parent_;
+
+        Frame *to = allocOldFrame(from->size_);
+        to->parent_ = from->parent_;
+        to->code_ = from->code_;
+        std::copy(from->slots_, from->slots_ + from->size_, to->slots_);
+        copy = to;
+        from->gcFlags_ |= GC_FORWARDED;
+        from->parent_ = copy;
     }
-    
-    for (auto v : stackRoots_)
+    promoted_.push_back(copy);
+    return copy;
+}
+
+// evacuates the objects v points to
+void Kgc::scavenge(const Value *v)
+{
+    if (IS_PAIR(v))
     {
-        mark(v);
+        Cell *c = TK_PAIR(v);
+        storeField(c->head_, evacuate(c->head_));
+        storeField(c->tail_, evacuate(c->tail_));
+        return;
+    }
+
+    v = untag(v);
+    switch (v->type())
+    {
+        case ValueType::COMP_PROC:
+        {
+            CompoundProc *cp = const_cast<CompoundProc *>(static_cast<const CompoundProc *>(v));
+            storeField(cp->code_, evacuate(cp->code_));
+            storeField(cp->env_, evacuate(cp->env_));
+            break;
+        }
+        case ValueType::FRAME:
+        {
+            Frame *frame = const_cast<Frame *>(static_cast<const Frame *>(v));
+            storeField(frame->parent_, evacuate(frame->parent_));
+            storeField(frame->code_, evacuate(frame->code_));
+            for (size_t i = 0; i != frame->size_; ++i)
+                storeField(frame->slots_[i], evacuate(frame->slots_[i]));
+            break;
+        }
+        case ValueType::BINDING:
+        {
+            Binding *binding = const_cast<Binding *>(static_cast<const Binding *>(v));
+            storeField(binding->value_, evacuate(binding->value_));
+            break;
+        }
+        case ValueType::VECTOR:
+        {
+            Vector *vector = const_cast<Vector *>(static_cast<const Vector *>(v));
+            for (size_t i = 0; i != vector->size_; ++i)
+                storeField(vector->elements_[i], evacuate(vector->elements_[i]));
+            break;
+        }
+        case ValueType::HASH_TABLE:
+        {
+            HashTable *table = const_cast<HashTable *>(static_cast<const HashTable *>(v));
+            for (auto &&entry : table->entries_)
+            {
+                entry.key = evacuate(entry.key);
+                entry.value = evacuate(entry.value);
+            }
+            break;
+        }
+        case ValueType::CODE:
+        {
+            Code *code = const_cast<Code *>(static_cast<const Code *>(v));
+            code->variables_ = evacuate(code->variables_);
+            for (auto &&constant : code->constants_)
+                constant = evacuate(constant);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Kgc::remember(const Value *v)
+{
+    if (IS_PAIR(v))
+    {
+        size_t word;
+        uint64_t bit;
+        Page *page = pageOf(TK_PAIR(v));
+        slotBit(page, TK_PAIR(v), word, bit);
+        if (page->remembered[word] & bit) return;
+        page->remembered[word] |= bit;
+    } else
+    {
+        if (v->gcFlags_ & GC_REMEMBERED) return;
+        v->gcFlags_ |= GC_REMEMBERED;
+    }
+    remembered_.push_back(v);
+}
+
+// marks v, unless it is an immediate, young or already marked
+bool Kgc::setMark(const Value *v)
+{
+    if (!v || IS_IMMEDIATE(v) || isYoung(v)) return false;
+    uint64_t bit;
+    uint64_t *word = markWord(v, bit);
+    if (marking_ && concurrent_)
+    {
+        // the marker thread sets bits in the same words
+        if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return false;
+    } else
+    {
+        if (*word & bit) return false;
+        *word |= bit;
     }
+    ++markedObjects_;
+    return true;
 }
 
+// shades v grey: marks it and leaves it on the mark stack to be scanned
+void Kgc::mark(const Value *v)
+{
+    if (setMark(v))
+    {
+        markStack_.push_back(v);
+    }
+}
 
-Value* Kgc::allocSpecial(ValueType type)
+void Kgc::traceMarkStack()
 {
-    std::vector<Value *> &v = reserved[(int)type];
-    
-    if (!v.empty())
+    if (markThreads_ > 1)
     {
-        Value *last = v.back();
-        v.pop_back();
-        return last;
+        traceParallel();
+        return;
+    }
+    while (!markStack_.empty())
+    {
+        const Value *v = markStack_.back();
+        markStack_.pop_back();
+        scan(v, *this);
     }
-    return allocNew(type);
 }
 
+void Kgc::traceParallel()
+{
+    std::unique_ptr<MarkWorker[]> workers{new MarkWorker[markThreads_]};
+    for (size_t i = 0; i != markThreads_; ++i)
+        workers[i].gc = this;
+    for (size_t i = 0; i != markStack_.size(); ++i)
+        workers[i % markThreads_].grey.push_back(markStack_[i]);
+    markStack_.clear();
+
+    std::atomic<size_t> idle{0};
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i != markThreads_; ++i)
+        threads.emplace_back([this, &workers, i, &idle] { traceWorker(workers.get(), i, idle); });
+    traceWorker(workers.get(), 0, idle);
+    for (auto &&thread : threads)
+        thread.join();
 
-Value* Kgc::allocNew(ValueType type)
+    unsigned long busiest = 0;
+    for (size_t i = 0; i != markThreads_; ++i)
+    {
+        markedObjects_ += workers[i].marked;
+        steals_ += workers[i].steals;
+        parallelMarked_ += workers[i].marked;
+        busiest = std::max(busiest, workers[i].marked);
+    }
+    busiestMarked_ += busiest;
+}
+
+// traces until every worker is idle with nothing shared
+void Kgc::traceWorker(MarkWorker *workers, size_t self, std::atomic<size_t> &idle)
 {
-    switch (type)
+    MarkWorker &me = workers[self];
+    while (true)
     {
-        case ValueType::COMP_PROC:
-            return new CompoundProc;
-        case ValueType::CELL:
-            return new Cell;
-        case ValueType::INPUT_PORT:
-            return new InputPort;
-        case ValueType::OUTPUT_PORT:
-            return new OutputPort;
-        case ValueType::PRIM_PROC:
-            return new PrimitiveProc;
-        case ValueType::BOOLEAN:
-            return new Boolean;
-        case ValueType::STRING:
-            return new String;
-        case ValueType::SYMBOL:
-            return new Symbol;
-        case ValueType::NIL:
-            return new Nil;
-        case ValueType::EOF_OBJECT:
-            return new Eof;
-        default:
-            assert(false);
-            return nullptr;
+        while (!me.grey.empty())
+        {
+            const Value *v = me.grey.back();
+            me.grey.pop_back();
+            scan(v, me);
+            if (me.grey.size() > 64 && me.numShared == 0)
+            {
+                me.share();
+            }
+        }
+        if (me.take(me)) continue;
+
+        bool stolen = false;
+        for (size_t i = 1; i != markThreads_ && !stolen; ++i)
+            stolen = me.take(workers[(self + i) % markThreads_]);
+        if (stolen)
+        {
+            ++me.steals;
+            continue;
+        }
+
+        ++idle;
+        while (true)
+        {
+            bool work = false;
+            for (size_t i = 0; i != markThreads_ && !work; ++i)
+                work = workers[i].numShared != 0;
+            if (work)
+            {
+                --idle;
+                break;
+            }
+            if (idle == markThreads_) return;
+            std::this_thread::yield();
+        }
+    }
+}
+
+// marks the objects v points to, following the spine of a list in place
+template <typename Marker>
+void Kgc::scan(const Value *v, Marker &marker)
+{
+    for (int n = 0; IS_PAIR(v); ++n)
+    {
+        if (n == 256)
+        {
+            // the rest waits for the next round, or a thief
+            marker.pushTail(v);
+            return;
+        }
+        const Cell *c = TK_PAIR(v);
+        marker.mark(loadField(c->head_));
+        v = loadField(c->tail_);
+        if (!marker.setMark(v)) return;
+    }
+
+    v = untag(v);
+    if (marker.defer(v)) return;
+    if (v->type() == ValueType::COMP_PROC)
+    {
+        const CompoundProc *cp = static_cast<const CompoundProc *>(v);
+        marker.mark(loadField(cp->code_));
+        marker.mark(loadField(cp->env_));
+    } else if (v->type() == ValueType::FRAME)
+    {
+        const Frame *frame = static_cast<const Frame *>(v);
+        marker.mark(loadField(frame->parent_));
+        marker.mark(loadField(frame->code_));
+        for (size_t i = 0; i != frame->size_; ++i)
+            marker.mark(loadField(frame->slots_[i]));
+    } else if (v->type() == ValueType::ENVIRONMENT)
+    {
+        const Environment *env = static_cast<const Environment *>(v);
+        for (auto &&binding : env->bindings_)
+        {
+            marker.mark(binding.first);
+            marker.mark(binding.second);
+        }
+    } else if (v->type() == ValueType::BINDING)
+    {
+        const Binding *binding = static_cast<const Binding *>(v);
+        marker.mark(binding->symbol_);
+        marker.mark(loadField(binding->value_));
+    } else if (v->type() == ValueType::CODE)
+    {
+        const Code *code = static_cast<const Code *>(v);
+        marker.mark(code->variables_);
+        for (auto constant : code->constants_)
+            marker.mark(constant);
+    } else if (v->type() == ValueType::VECTOR)
+    {
+        const Vector *vector = static_cast<const Vector *>(v);
+        for (size_t i = 0; i != vector->size_; ++i)
+            marker.mark(loadField(vector->elements_[i]));
+    } else if (v->type() == ValueType::HASH_TABLE)
+    {
+        const HashTable *table = static_cast<const HashTable *>(v);
+        for (auto &&entry : table->entries_)
+        {
+            marker.mark(entry.key);
+            marker.mark(entry.value);
+        }
     }
 }
 
-void Kgc::dealloc(const Value *v)
+
+// sweeps the page at the cursor into the free list, or releases it
+void Kgc::sweepNext(size_t sizeClass)
 {
-    --numObjects_;
-    reserved[(int)v->type()].push_back(const_cast<Value *>(v));
+    auto &pages = pages_[sizeClass];
+    auto &cursor = sweepCursor_[sizeClass];
+    Page *page = pages[cursor];
+    assert(page->unswept);
+    if (!sweepPage(page))
+    {
+        // the last page is unswept as well
+        pages[cursor] = pages.back();
+        pages.pop_back();
+        releasePage(page);
+        return;
+    }
+    ++cursor;
+    for (size_t i = page->numSlots; i != 0; --i)
+    {
+        if (!(page->live[(i - 1) / 64] & (uint64_t(1) << ((i - 1) % 64))))
+        {
+            void *slot = page->slots() + (i - 1) * page->objectSize;
+            *static_cast<void **>(slot) = freeSlots_[sizeClass];
+            freeSlots_[sizeClass] = slot;
+        }
+    }
 }
 
+void Kgc::finishSweep()
+{
+    for (size_t c = 0; c != NUM_SIZE_CLASSES; ++c)
+    {
+        while (sweepCursor_[c] != pages_[c].size())
+            sweepNext(c);
+    }
+}
 
+// large objects are few, they are swept right after the mark
+void Kgc::sweepLarge()
+{
+    size_t kept = 0;
+    for (auto page : largePages_)
+    {
+        if (!sweepPage(page))
+        {
+            releasePage(page);
+            continue;
+        }
+        largePages_[kept++] = page;
+    }
+    largePages_.resize(kept);
+}
+
+// frees the unmarked objects of the page, and tells whether any is left
+bool Kgc::sweepPage(Page *page)
+{
+    uint64_t any = 0;
+    for (size_t w = 0; w != GC_PAGE_WORDS; ++w)
+    {
+        if (page->sizeClass != PAIR_CLASS)
+        {
+            for (uint64_t dead = page->live[w] & ~page->marks[w]; dead; dead &= dead - 1)
+            {
+                auto i = w * 64 + __builtin_ctzll(dead);
+                destroy(reinterpret_cast<Value *>(page->slots() + i * page->objectSize));
+            }
+        }
+        page->live[w] &= page->marks[w];
+        page->marks[w] = 0;
+        any |= page->live[w];
+    }
+    page->unswept = false;
+    return any != 0;
+}
+
+void Kgc::markAll()
+{
+    for (auto frame = shadowStack_; frame; frame = frame->prev)
+    {
+        for (size_t i = 0; i != frame->size; ++i)
+            mark(*frame->roots[i]);
+    }
+
+    for (auto v : stackRoots_)
+    {
+        mark(v);
+    }
+
+    for (auto stack : rootStacks_)
+    {
+        for (auto v : *stack)
+            mark(v);
+    }
+}
+
+
+
+// no vtable: the type tells which destructor to call
+void Kgc::destroy(Value *v)
+{
+    switch (v->type())
+    {
+        case ValueType::INPUT_PORT:
+            static_cast<InputPort *>(v)->~InputPort();
+            break;
+        case ValueType::OUTPUT_PORT:
+            static_cast<OutputPort *>(v)->~OutputPort();
+            break;
+        case ValueType::STRING:
+            static_cast<String *>(v)->~String();
+            break;
+        case ValueType::CODE:
+            static_cast<Code *>(v)->~Code();
+            break;
+        case ValueType::ENVIRONMENT:
+            static_cast<Environment *>(v)->~Environment();
+            break;
+        case ValueType::HASH_TABLE:
+            static_cast<HashTable *>(v)->~HashTable();
+            break;
+        default:
+            break;
+    }
+}
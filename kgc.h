@@ -2,71 +2,337 @@
 #define KAT_GC_H_INCLUDED
 
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <cassert>
 #include "kvalue.h"
 
 #define INITIAL_GC_THRESHOLD 256
+#define INITIAL_GC_BYTES (8 * 1024 * 1024)   // bytes outside the slots allocated between two marks
+#define NURSERY_SIZE (4096 * 1024)
+#define GC_PAUSE_BUDGET 0           // microseconds a marking slice may take, 0 to stop the world
+#define MARK_SLICE_ALLOCATIONS 4096 // allocations between two marking slices
+#define MAX_REMARKS 8               // remarks before a mark is finished in one pause
+#define MARK_THREADS 1              // threads tracing the pauses that mark to the end
+#define MAX_MARK_THREADS 64
 
-class GcGuard;
+#define GC_REMEMBERED 1u
+#define GC_FORWARDED 2u
 
+#define GC_PAGE_SIZE (64 * 1024)
+#define GC_PAGE_WORDS 64            // bitmap words: one bit per 16 bytes of a page
+#define NUM_SIZE_CLASSES 10
+#define PAIR_CLASS 0                // class 0 holds the pairs, which have no header
+#define LARGE_CLASS NUM_SIZE_CLASSES
+
+template <size_t N> class GcRoots;
+class SymbolTable;
+
+// Maps names to objects without keeping them alive: the entries of the
+// objects found dead by a mark are dropped
+using WeakTable = std::unordered_map<std::string, const Value *>;
+
+// A record of the shadow stack: the addresses of the locals of a native
+// frame that hold values. The records are linked from the innermost out.
+struct ShadowFrame
+{
+    const ShadowFrame *prev;
+    size_t size;
+    const Value ** const *roots;
+};
+struct MarkWorker;
+
+/*
+ *  The old space is made of pages aligned to GC_PAGE_SIZE. Every page holds
+ *  objects of a single size class, and starts with one bit per slot for
+ *  each of: the slot is in use, the slot is marked, the slot is in the
+ *  remembered set (pairs only, the other objects remember it in their
+ *  header). An object bigger than the largest size class gets a large page
+ *  of its own, which may span more than GC_PAGE_SIZE bytes.
+ *
+ *      +--------+---------+---------+--------+--------+-----
+ *      | header | live    | marks   | rem.   | slot 0 | slot 1 ...
+ *      +--------+---------+---------+--------+--------+-----
+ */
+struct Page
+{
+    size_t sizeClass;
+    size_t objectSize;
+    size_t numSlots;
+    size_t mappedSize;
+    uint64_t live[GC_PAGE_WORDS];
+    uint64_t marks[GC_PAGE_WORDS];
+    uint64_t remembered[GC_PAGE_WORDS];
+    bool unswept;               // the marks are those of the last collection
+
+    char* slots() { return reinterpret_cast<char *>(this) + ((sizeof(Page) + 15) & ~size_t(15)); }
+};
+
+/*
+ *  Cells, compound procedures, frames, vectors, bytevectors and short
+ *  strings are allocated by bumping a pointer in the nursery. A minor
+ *  collection copies the nursery objects reachable from the roots and from
+ *  the remembered set into the old space, breadth first (Cheney), and
+ *  empties the nursery. Everything else lives in the old
+ *  space, which is collected by mark & sweep. Old objects are allocated
+ *  from the free list of their size class, which is threaded through the
+ *  free slots of its pages.
+ *
+ *  A major collection only marks. The pages of a size class are swept one
+ *  at a time by the allocator, when the free list of the class runs dry:
+ *
+ *      pages_[c]:  | swept ... | unswept ... |
+ *                              ^ sweepCursor_[c]
+ *
+ *  Whatever is left unswept is swept before the next mark.
+ *
+ *  Unless the pause budget is 0, the mark is incremental: it advances in
+ *  slices of at most pauseBudget_ microseconds, one every few allocations.
+ *  Between slices the vm runs, and the write barrier shades the values
+ *  stored into old objects grey, so that no black object ever points to a
+ *  white one. Objects allocated in the old space while marking, including
+ *  the survivors of minor collections, are grey. When the mark stack runs
+ *  empty, a remark empties the nursery and rescans the roots; the mark ends
+ *  when a remark finds nothing new, and goes on in slices otherwise. The
+ *  MAX_REMARKSth remark traces what is left in one pause, and so does the
+ *  slice that finds the bytes allocated outside the slots at twice the
+ *  threshold that starts a mark.
+ *
+ *  The budget bounds the tracing in the slices, not the pauses: the minor
+ *  collections, the shading of the roots when a mark starts and the last
+ *  remark take as long as they take, and so do the pauses of the
+ *  concurrent mode. The statistics, printed on exit when asked for, report
+ *  the longest pause and how many marks had to be finished past the budget.
+ *
+ *  A pause that marks to the end (the whole mark when the budget is 0, the
+ *  last pause otherwise) is traced by markThreads_ threads. The grey
+ *  objects are dealt out to the threads, which set the mark bits with an
+ *  atomic or. Every thread works on a private stack and shares part of it
+ *  when the others may be starving; idle threads steal from what is shared.
+ *
+ *  In concurrent mode, a short pause empties the nursery and shades the
+ *  roots, then a marker thread traces while the vm runs. The invariant is
+ *  a snapshot at the beginning: snapshotBarrier shades the value a store
+ *  is about to overwrite, and objects allocated in the old space meanwhile
+ *  are black. The marker leaves environments, code objects and hash
+ *  tables, whose containers the vm may be growing, to the vm thread,
+ *  which scans them at its safepoints and hands over what it shaded. The
+ *  mark ends at the safepoint that finds the marker idle with nothing left
+ *  to hand over.
+ *
+ *  A mark starts once the old space holds twice the objects the last one
+ *  left, or once the bytes allocated outside the slots since then, the
+ *  chars of long strings and the large pages, outgrow the pages of the
+ *  heap, large ones included.
+ *
+ *  Objects move, so collections only happen at a safepoint of the vm, where
+ *  every live object is reachable from a root whose address the collector
+ *  knows. Until then, allocations that do not fit in the nursery go to the
+ *  old space.
+ *
+ *  Storing a pointer into an old object must be followed by a call to
+ *  writeBarrier, which remembers old objects that point into the nursery
+ *  and shades the stored value while marking incrementally. Overwriting a
+ *  pointer in a heap object must be preceded by a call to snapshotBarrier.
+ */
 class Kgc
 {
 public:
-    explicit Kgc(unsigned int maxObjects = INITIAL_GC_THRESHOLD)
-    : numObjects_(0), maxObjects_(maxObjects) {}
+    explicit Kgc(unsigned int maxObjects = INITIAL_GC_THRESHOLD, long pauseBudget = GC_PAUSE_BUDGET,
+                 unsigned int markThreads = MARK_THREADS, bool concurrent = false, bool stats = false);
     
     ~Kgc();
     
-    void pushStackRoot(const Value *v) { stackRoots_.push_back(v); }
-    void pushLocalStackRoot(const Value **v) { localStackRoots_.push_back(v); }
-    void popLocalStackRoot() { localStackRoots_.pop_back(); }
+    // the stack roots are not evacuated by a minor collection: they must
+    // be old, like the symbols and the global environment
+    void pushStackRoot(const Value *v)
+    {
+        assert(!isYoung(v));
+        stackRoots_.push_back(v);
+    }
+    void pushRootStack(std::vector<const Value *> *stack) { rootStacks_.push_back(stack); }
+    void addWeakTable(WeakTable *table) { weakTables_.push_back(table); }
+    void setSymbolTable(SymbolTable *table) { symbolTable_ = table; }
     void collect();
+    void safepoint() { if (collectionPending_) collect(); }
+
+    // counts the minor collections, each of which moves the young objects
+    size_t epoch() const { return epoch_; }
+
+    bool isYoung(const Value *v) const
+    {
+        auto p = reinterpret_cast<uintptr_t>(v);
+        return !IS_IMMEDIATE(v) &&
+               (p & PTR_MASK) - reinterpret_cast<uintptr_t>(nursery_) < NURSERY_SIZE;
+    }
+
+    void writeBarrier(const Value *object, const Value *v)
+    {
+        if (isYoung(v) && !isYoung(object)) remember(object);
+        if (marking_ && !concurrent_) mark(v);
+    }
+
+    void snapshotBarrier(const Value *old)
+    {
+        if (marking_ && concurrent_) mark(old);
+    }
+
+    // an object found in a weak table may be white, and must survive the
+    // mark in progress now that the vm holds it again
+    const Value* readWeak(const Value *v)
+    {
+        if (marking_) mark(v);
+        return v;
+    }
 
     Value* allocValue(ValueType type);
+    Cell* allocCell();
+    Frame* allocFrame(size_t size);
+    Vector* allocVector(size_t size);
+    Bytevector* allocBytevector(size_t size);
+    String* allocString(size_t size);
+    // for the strings a weak table points to, which must not move
+    String* allocOldString(size_t size);
     
 private:
+    bool setMark(const Value *v);
     void mark(const Value *v);
-    void sweep();
+    void pushTail(const Value *v) { markStack_.push_back(v); }
+    bool defer(const Value *) const { return false; }
+    void traceMarkStack();
+    void traceParallel();
+    void traceWorker(MarkWorker *workers, size_t self, std::atomic<size_t> &idle);
+    template <typename Marker> void scan(const Value *v, Marker &marker);
+    void sweepLarge();
+    void finishSweep();
+    bool sweepPage(Page *page);
+    void sweepNext(size_t sizeClass);
+    void refill(size_t sizeClass);
     void markAll();
-    void dealloc(const Value *v);
-    Value* allocSpecial(ValueType type);
-    Value* allocNew(ValueType type);
+    void minorCollect();
+    void majorCollect();
+    void startMark();
+    void markSlice(std::chrono::steady_clock::time_point deadline);
+    void finishMark();
+    void endMark();
+    void pruneWeakTables();
+    void paceMarking();
+    void startConcurrentMark();
+    void serviceConcurrentMark(bool wait);
+    void traceConcurrently();
+    const Value* evacuate(const Value *v);
+    void scavenge(const Value *v);
+    void remember(const Value *v);
+    void* allocYoung(size_t bytes);
+    void* allocSlot(size_t sizeClass);
+    void* allocLarge(size_t bytes);
+    Value* allocOld(ValueType type);
+    Frame* allocOldFrame(size_t size);
+    Vector* allocOldVector(size_t size);
+    Bytevector* allocOldBytevector(size_t size);
+    void addPage(size_t sizeClass);
+    void releasePage(Page *page);
+    void destroy(Value *v);
+    bool heapFull() const { return numObjects_ >= maxObjects_ || allocatedBytes_ >= maxAllocatedBytes_; }
     
     
     unsigned int numObjects_;
     unsigned int maxObjects_;
-    const Value* firstObject_ = nullptr;
     unsigned int totalObjects_[(int)ValueType::MAX] = {0};
-    
-    std::vector<Value *> reserved[(int)ValueType::MAX];
+    size_t allocatedBytes_ = 0;         // outside the slots, since the last mark
+    size_t maxAllocatedBytes_ = INITIAL_GC_BYTES;
+    size_t largeBytes_ = 0;             // mapped by the large pages
+    bool collectionPending_ = false;
+    bool nurseryFull_ = false;
+
+    std::vector<Page *> pages_[NUM_SIZE_CLASSES];
+    void *freeSlots_[NUM_SIZE_CLASSES] = {nullptr};
+    size_t sweepCursor_[NUM_SIZE_CLASSES] = {0};
+    std::vector<Page *> largePages_;
+    std::vector<Page *> emptyPages_;   // released to the os, ready for reuse
+
+    std::vector<const Value *> markStack_;
+    unsigned long markedObjects_ = 0;
+    std::chrono::steady_clock::duration markTime_{0};
+    unsigned int markThreads_;
+    unsigned long steals_ = 0;
+    unsigned long parallelMarked_ = 0;
+    unsigned long busiestMarked_ = 0;      // summed over the parallel traces
+    bool concurrent_;
+    std::unique_ptr<MarkWorker> marker_;   // the marker thread, while it runs
+    std::thread markerThread_;
+    bool marking_ = false;
+    unsigned int sliceAllocations_ = 0;
+    unsigned int numObjectsAtMark_ = 0;
+    unsigned long markedAtMark_ = 0;
+    std::chrono::steady_clock::duration markTimeAtMark_{0};
+    unsigned int remarks_ = 0;
+    unsigned long numRemarks_ = 0;
+    unsigned long forcedFinishes_ = 0;
+
+    std::chrono::microseconds pauseBudget_;
+    bool stats_;
+    unsigned long numPauses_ = 0;
+    std::chrono::steady_clock::duration pauseTime_{0};
+    std::chrono::steady_clock::duration maxPause_{0};
+    std::chrono::steady_clock::duration maxMarkPause_{0};   // the part spent marking
+
+    char *nursery_;
+    char *nurseryTop_;
+    std::vector<const Value *> remembered_;
+    std::vector<const Value *> promoted_;
+    size_t epoch_ = 0;
     
     std::vector<const Value  *> stackRoots_;
-    std::vector<const Value **> localStackRoots_;
+    const ShadowFrame *shadowStack_ = nullptr;
+    std::vector<std::vector<const Value *> *> rootStacks_;
+    std::vector<WeakTable *> weakTables_;
+    SymbolTable *symbolTable_ = nullptr;
 
-    friend class GcGuard;
+    template <size_t N> friend class GcRoots;
 };
 
-class GcGuard
+/*
+ *  Roots the N locals whose addresses it is given until the end of the
+ *  scope. The record lives in the native frame, pushing it is one store
+ *  to the top of the shadow stack and popping it another.
+ *  Collections only happen at the safepoint of a call in Kvm::run, so only
+ *  the locals live across a call that may run code need to be rooted.
+ *
+ *      GcRoots<2> roots{gc_, &code, &env};
+ */
+template <size_t N>
+class GcRoots : private ShadowFrame
 {
 public:
-    explicit GcGuard(Kgc &gc) : gc_(gc) {}
-
-    ~GcGuard()
+    template <typename... Locals>
+    GcRoots(Kgc &gc, Locals... locals)
+    : ShadowFrame{gc.shadowStack_, N, locals_}, gc_(gc), locals_{locals...}
     {
-        while (times_)
-        {
-            gc_.popLocalStackRoot();
-            --times_;
-        }
+        static_assert(sizeof...(Locals) == N, "GcRoots<N> takes N addresses");
+        // not dangling: the destructor pops the record before its frame dies
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+        gc.shadowStack_ = this;
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
     }
 
-    void pushLocalStackRoot(const Value **local)
-    {
-        gc_.pushLocalStackRoot(local);
-        ++times_;
-    }
+    ~GcRoots() { gc_.shadowStack_ = prev; }
+
+    GcRoots(const GcRoots &) = delete;
+    GcRoots& operator=(const GcRoots &) = delete;
 private:
     Kgc &gc_;
-    long times_ = 0;
+    const Value **locals_[N];
 };
 
 #endif /* KAT_GC_H_INCLUDED */
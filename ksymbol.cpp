@@ -0,0 +1,143 @@
+#include "ksymbol.h"
+#include <cstring>
+#include <cstddef>
+
+#define INITIAL_SYMBOL_SLOTS 256
+
+SymbolTable::SymbolTable()
+{
+    slots_.assign(INITIAL_SYMBOL_SLOTS, Slot{0, nullptr});
+}
+
+// FNV-1a
+size_t SymbolTable::hash(std::string_view name)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : name)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+Symbol* SymbolTable::find(std::string_view name, size_t hash) const
+{
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask; slots_[i].name; i = (i + 1) & mask)
+    {
+        const Slot &slot = slots_[i];
+        if (slot.hash == hash && slot.name->length == name.size() &&
+            memcmp(slot.name->chars, name.data(), name.size()) == 0)
+        {
+            return slot.name->symbol;
+        }
+    }
+    return nullptr;
+}
+
+void SymbolTable::insert(Symbol *s, std::string_view name, size_t hash)
+{
+    // at most half full, for the probes to stay short
+    if ((size_ + 1) * 2 > slots_.size())
+    {
+        grow(slots_.size() * 2);
+    }
+    Name *n = copyName(s, name);
+    s->value_ = n->chars;
+    s->length_ = name.size();
+    s->hash_ = hash;
+    place(hash, n);
+    ++size_;
+}
+
+void SymbolTable::place(size_t hash, Name *name)
+{
+    size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+    while (slots_[i].name)
+    {
+        i = (i + 1) & mask;
+    }
+    slots_[i] = Slot{hash, name};
+}
+
+void SymbolTable::grow(size_t capacity)
+{
+    std::vector<Slot> slots(capacity, Slot{0, nullptr});
+    slots_.swap(slots);
+    for (auto &slot : slots)
+    {
+        if (slot.name) place(slot.hash, slot.name);
+    }
+}
+
+// the pruned slots left holes in the probe sequences, so the symbols left
+// are placed again, in a table sized for them
+void SymbolTable::rebuild()
+{
+    if (deadBytes_ > arenaBytes_ / 2 && arenaBytes_ > SYMBOL_ARENA_CHUNK)
+    {
+        compact();
+    }
+    size_t capacity = INITIAL_SYMBOL_SLOTS;
+    while (capacity < size_ * 4)
+    {
+        capacity *= 2;
+    }
+    grow(capacity);
+}
+
+// the bytes of a name record, rounded up to keep the records aligned
+size_t SymbolTable::nameBytes(size_t length)
+{
+    return (offsetof(Name, chars) + length + 1 + alignof(Name) - 1) & ~(alignof(Name) - 1);
+}
+
+SymbolTable::Name* SymbolTable::copyName(Symbol *s, std::string_view name)
+{
+    size_t bytes = nameBytes(name.size());
+    char *copy;
+    if (bytes > SYMBOL_ARENA_CHUNK)
+    {
+        // a chunk of its own, the current one is still in use
+        chunks_.emplace_back(new char[bytes]);
+        copy = chunks_.back().get();
+    } else
+    {
+        if (bytes > static_cast<size_t>(chunkEnd_ - chunkTop_))
+        {
+            chunks_.emplace_back(new char[SYMBOL_ARENA_CHUNK]);
+            chunkTop_ = chunks_.back().get();
+            chunkEnd_ = chunkTop_ + SYMBOL_ARENA_CHUNK;
+        }
+        copy = chunkTop_;
+        chunkTop_ += bytes;
+    }
+    arenaBytes_ += bytes;
+
+    Name *n = reinterpret_cast<Name *>(copy);
+    n->symbol = s;
+    n->length = name.size();
+    memcpy(n->chars, name.data(), name.size());
+    n->chars[name.size()] = '\0';
+    return n;
+}
+
+// copies the names of the symbols left into new chunks, and frees the old
+void SymbolTable::compact()
+{
+    std::vector<std::unique_ptr<char[]>> chunks;
+    chunks.swap(chunks_);
+    chunkTop_ = chunkEnd_ = nullptr;
+    arenaBytes_ = deadBytes_ = 0;
+    for (auto &slot : slots_)
+    {
+        if (slot.name)
+        {
+            Symbol *s = slot.name->symbol;
+            slot.name = copyName(s, {slot.name->chars, slot.name->length});
+            s->value_ = slot.name->chars;
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef KAT_SYMBOL_H_INCLUDED
+#define KAT_SYMBOL_H_INCLUDED
+
+#include <vector>
+#include <memory>
+#include <string_view>
+#include "kvalue.h"
+
+#define SYMBOL_ARENA_CHUNK (64 * 1024)  // bytes of names per chunk of the arena
+
+///////////////////////////////////////////////////////////////////////////////
+/*
+ *  Interns the symbols. The table is open addressed with linear probing.
+ *  Every slot keeps the hash of its symbol and points to the name in the
+ *  arena, next to the symbol it names, so that a lookup reads the symbol
+ *  only once found:
+ *
+ *      slots_  | hash | name | hash | name | 0 | nullptr | ...
+ *                         |
+ *                         v
+ *      arena   | ... | symbol | length | lambda\0 | symbol | length | ...
+ *                         |                ^
+ *                         v                |
+ *                     | Symbol | value_ ---+
+ *
+ *  The names are copied into chunks that are never moved while in use, so
+ *  a name stays valid for as long as its symbol is alive. The table is weak:
+ *  the collector prunes the symbols it found dead, and the arena gets
+ *  compacted when most of its bytes are dead names.
+ */
+class SymbolTable
+{
+public:
+    SymbolTable();
+
+    static size_t hash(std::string_view name);
+
+    // the symbol of the name, or nullptr
+    Symbol* find(std::string_view name, size_t hash) const;
+
+    // names a new symbol, that must not be in the table yet
+    void insert(Symbol *s, std::string_view name, size_t hash);
+
+    // drops the symbols that are not alive
+    template<typename Live>
+    void prune(Live isLive)
+    {
+        size_t dropped = 0;
+        for (auto &slot : slots_)
+        {
+            if (slot.name && !isLive(slot.name->symbol))
+            {
+                deadBytes_ += nameBytes(slot.name->length);
+                slot.name = nullptr;
+                ++dropped;
+            }
+        }
+        if (dropped)
+        {
+            size_ -= dropped;
+            rebuild();
+        }
+    }
+
+    size_t size() const { return size_; }
+
+private:
+    struct Name
+    {
+        Symbol *symbol;
+        size_t length;
+        char chars[1];
+    };
+
+    struct Slot
+    {
+        size_t hash;
+        Name *name;
+    };
+
+    static size_t nameBytes(size_t length);
+    void rebuild();
+    void grow(size_t capacity);
+    void place(size_t hash, Name *name);
+    Name* copyName(Symbol *s, std::string_view name);
+    void compact();
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char *chunkTop_ = nullptr;
+    char *chunkEnd_ = nullptr;
+    size_t arenaBytes_ = 0;     // the bytes of the names copied in the arena
+    size_t deadBytes_ = 0;      // the part of them that belongs to pruned symbols
+};
+
+#endif
@@ -32,16 +32,16 @@ const Value* cdddr(const Value *v)
 
 void set_car(Value *v, const Value *obj)
 {
-    assert(v->type() == ValueType::CELL);
-    Cell *c = static_cast<Cell *>(v);
-    c->head_ = obj;
+    assert(IS_PAIR(v));
+    Cell *c = TK_PAIR(v);
+    storeField(c->head_, obj);
 }
 
 void set_cdr(Value *v, const Value *obj)
 {
-    assert(v->type() == ValueType::CELL);
-    Cell *c = static_cast<Cell *>(v);
-    c->tail_ = obj;
+    assert(IS_PAIR(v));
+    Cell *c = TK_PAIR(v);
+    storeField(c->tail_, obj);
 }
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -10,20 +10,70 @@
 #include <fstream>
 #include <functional>
 #include <cstdint>
-
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <string_view>
+
+/*
+ *  The low bits of a value tell what it is:
+ *
+ *      xxx1    fixnum
+ *      0010    character
+ *      1010    constant: #f, #t, (), the eof object
+ *      x100    pair
+ *      x110    procedure, primitive or compound
+ *      x000    any other object, with a Value header
+ *
+ *  Pointers keep 3 tag bits. Characters and constants are not pointers and
+ *  share the 010 tag, told apart by a fourth bit.
+ */
+#define TAG_BITS 3
 #define TAG_MASK 0b111
 #define PTR_MASK ~TAG_MASK
 
-#define INT_MASK 0b001
-#define CHR_MASK 0b010
+#define IMM_BITS 4
+#define IMM_MASK 0b1111
+
+#define INT_MASK  0b001
+#define CHR_TAG   0b0010
+#define CONST_TAG 0b1010
+#define PAIR_TAG  0b100
+#define PROC_TAG  0b110
+
+// fixnums, characters and constants are not pointers: the set bits of the
+// mask are the tags 001, 010, 011, 101 and 111
+#define IMMEDIATE_TAGS 0b10101110
+#define IS_IMMEDIATE(v) (((IMMEDIATE_TAGS >> ((reinterpret_cast<intptr_t>(v)) & TAG_MASK)) & 1) != 0)
 
 #define IS_INT(v) (((reinterpret_cast<intptr_t>(v)) & INT_MASK) == INT_MASK)
 #define MK_INT(n) (((n) << 1) | 1)
 #define TK_INT(v) ((reinterpret_cast<intptr_t>(v)) >> 1)
 
-#define IS_CHR(v) (((reinterpret_cast<intptr_t>(v)) & CHR_MASK) == CHR_MASK)
-#define MK_CHR(c) (((c) << CHR_MASK) | CHR_MASK)
-#define TK_CHR(v) static_cast<char>(((reinterpret_cast<intptr_t>(v)) >> CHR_MASK))
+#define IS_CHR(v) (((reinterpret_cast<intptr_t>(v)) & IMM_MASK) == CHR_TAG)
+#define MK_CHR(c) (((c) << IMM_BITS) | CHR_TAG)
+#define TK_CHR(v) static_cast<char>(((reinterpret_cast<intptr_t>(v)) >> IMM_BITS))
+
+#define IS_CONST(v) (((reinterpret_cast<intptr_t>(v)) & IMM_MASK) == CONST_TAG)
+#define MK_CONST(n) reinterpret_cast<const Value *>(((n) << IMM_BITS) | CONST_TAG)
+
+// #f and #t differ in one bit only
+#define FALSE_VALUE      MK_CONST(0)
+#define TRUE_VALUE       MK_CONST(1)
+#define NIL_VALUE        MK_CONST(2)
+#define EOF_VALUE        MK_CONST(3)
+#define UNASSIGNED_VALUE MK_CONST(4)    // the value of a variable not yet defined
+
+#define IS_PAIR(v) (((reinterpret_cast<intptr_t>(v)) & TAG_MASK) == PAIR_TAG)
+#define MK_PAIR(c) reinterpret_cast<const Value *>(reinterpret_cast<intptr_t>(c) | PAIR_TAG)
+#define TK_PAIR(v) reinterpret_cast<Cell *>(reinterpret_cast<intptr_t>(v) & PTR_MASK)
+
+#define IS_PROC(v) (((reinterpret_cast<intptr_t>(v)) & TAG_MASK) == PROC_TAG)
+#define MK_PROC(p) reinterpret_cast<const Value *>(reinterpret_cast<intptr_t>(p) | PROC_TAG)
+#define TK_PROC(v) reinterpret_cast<Value *>(reinterpret_cast<intptr_t>(v) & PTR_MASK)
+
+// an untagged pointer to an object that starts with a Value header
+#define IS_HEAP(v) (((reinterpret_cast<intptr_t>(v)) & TAG_MASK) == 0)
 
 ///////////////////////////////////////////////////////////////////////////////
 enum class ValueType
@@ -38,6 +88,13 @@ enum class ValueType
     INPUT_PORT,
     OUTPUT_PORT,
     EOF_OBJECT,
+    CODE,
+    FRAME,
+    ENVIRONMENT,
+    BINDING,
+    VECTOR,
+    BYTEVECTOR,
+    HASH_TABLE,
     MAX
 };
 
@@ -46,31 +103,44 @@ enum class ValueType
 class Kvm;
 class Kgc;
 
+/*
+ *  The one word header of every object but the pairs. Objects are destroyed
+ *  by the collector according to their type, so there is no vtable.
+ */
 class Value
 {
 public:
     explicit Value(ValueType type) : type_(type) {}
-    virtual ~Value() {}
 
     ValueType type() const { return type_; }
 
 private:
     ValueType type_;
-    mutable unsigned int marked_ = 0;
-    const Value* next_ = nullptr;
+    mutable unsigned int gcFlags_ = 0;
     
     friend class Kvm;
     friend class Kgc;
 };
 
+// The pointer fields the marker thread reads while the vm stores to them
+// (see Kgc::scan) are loaded and stored whole, as relaxed atomics
+inline const Value* loadField(const Value * const &field)
+{
+    return __atomic_load_n(&field, __ATOMIC_RELAXED);
+}
+
+inline void storeField(const Value *&field, const Value *v)
+{
+    __atomic_store_n(&field, v, __ATOMIC_RELAXED);
+}
+
 //---------------------------------------------------------------------------
 class CompoundProc final : public Value
 {
 public:
     CompoundProc() : Value(ValueType::COMP_PROC) {}
 private:
-    const Value *parameters_ = nullptr;
-    const Value *body_ = nullptr;
+    const Value *code_ = nullptr;
     const Value *env_ = nullptr;
 
     friend class Kgc;
@@ -78,13 +148,125 @@ private:
 };
 
 //---------------------------------------------------------------------------
-class Cell final : public Value
+// The variables of one procedure call. The slots are allocated inline,
+// together with the frame (see Kgc::allocFrame).
+class Frame final : public Value
 {
 public:
-    Cell() : Value(ValueType::CELL) {}
+    Frame() : Value(ValueType::FRAME) {}
 private:
-    const Value *head_ = nullptr;
-    const Value *tail_ = nullptr;
+    const Value *parent_ = nullptr;
+    const Value *code_ = nullptr;     // names the slots
+    size_t size_ = 0;
+    const Value *slots_[1];
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+// The elements follow the header, like the slots of a frame
+class Vector final : public Value
+{
+public:
+    Vector() : Value(ValueType::VECTOR) {}
+    size_t size() const { return size_; }
+private:
+    size_t size_ = 0;
+    const Value *elements_[1];
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+// The bytes follow the header. There is room for a pointer even when empty,
+// for the collector to forward a young bytevector through.
+class Bytevector final : public Value
+{
+public:
+    Bytevector() : Value(ValueType::BYTEVECTOR) {}
+    size_t size() const { return size_; }
+    uint8_t* data() { return bytes_; }
+    const uint8_t* data() const { return bytes_; }
+private:
+    size_t size_ = 0;
+    uint8_t bytes_[sizeof(const Value *)];
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+/*
+ *  An eq? hash table, open addressed with linear probing over a flat array
+ *  of entries:
+ *
+ *      entries_  | key | value | nullptr | nullptr | nullptr | UNASSIGNED |
+ *                    live          empty               deleted
+ *
+ *  Symbols hash by their name, immediates by their bits and the other
+ *  objects by their address. An object in the nursery moves at the next
+ *  minor collection, so a table that hashed one by its address hashes its
+ *  keys again on the first use after that collection.
+ */
+class HashTable final : public Value
+{
+public:
+    HashTable() : Value(ValueType::HASH_TABLE) {}
+    size_t size() const { return size_; }
+private:
+    struct Entry
+    {
+        const Value *key;
+        const Value *value;
+    };
+
+    std::vector<Entry> entries_;
+    size_t size_ = 0;           // the live entries
+    size_t used_ = 0;           // the live and the deleted entries
+    size_t youngKeys_ = 0;      // the keys hashed by their nursery address
+    size_t epoch_ = 0;          // the minor collections when they were hashed
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+// A top level environment maps every symbol it knows to a Binding, which
+// holds the value. Compiled code refers to the Binding directly.
+class Environment final : public Value
+{
+public:
+    Environment() : Value(ValueType::ENVIRONMENT) {}
+private:
+    std::unordered_map<const Value *, const Value *> bindings_;
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+class Binding final : public Value
+{
+public:
+    Binding() : Value(ValueType::BINDING) {}
+private:
+    const Value *symbol_ = nullptr;
+    const Value *value_ = nullptr;
+
+    friend class Kgc;
+    friend class Kvm;
+};
+
+//---------------------------------------------------------------------------
+// A pair has no header: it is known by the PAIR_TAG of the pointers to it.
+// The collector keeps the mark bits of the pairs on the side.
+class Cell final
+{
+private:
+    const Value *head_;
+    const Value *tail_;
 
     friend class Kgc;
     friend class Kvm;
@@ -95,6 +277,8 @@ private:
     friend void set_cdr(Value *v, const Value *obj);
 };
 
+static_assert(sizeof(Cell) == 2 * sizeof(const Value *), "pairs have no header");
+
 //---------------------------------------------------------------------------
 class InputPort final : public Value
 {
@@ -110,7 +294,7 @@ private:
 class OutputPort final : public Value
 {
 public:
-    OutputPort() : Value(ValueType::INPUT_PORT) {}
+    OutputPort() : Value(ValueType::OUTPUT_PORT) {}
 private:
     std::unique_ptr<std::ofstream> output;
     
@@ -118,51 +302,86 @@ private:
 };
 
 //---------------------------------------------------------------------------
+// Primitives receive their arguments in place, as a pointer to the argc
+// values on top of the vm stack. The pointer is only valid until the vm
+// stack is used again.
+using PrimitiveFunc = const Value *(*)(Kvm *, int argc, const Value * const *argv);
+
+#define VARIADIC -1
+
 class PrimitiveProc final : public Value
 {
 public:
     explicit PrimitiveProc()
     : Value(ValueType::PRIM_PROC) {}
 private:
-    const Value *(*func_)(Kvm *, const Value *) = nullptr;
+    PrimitiveFunc func_ = nullptr;
+    int minArgs_ = 0;
+    int maxArgs_ = VARIADIC;
     
     friend class Kvm;
 };
 
 //---------------------------------------------------------------------------
-class Nil final : public Value
+/*
+ *  A string of up to STRING_INLINE_CHARS chars keeps them in the object,
+ *  a longer one in a buffer of its own, freed with the string:
+ *
+ *      | header | size | literal | hello\0          |
+ *      | header | size | literal | heap_ |  --> | a longer string ...\0 |
+ *
+ *  The chars are nul terminated either way. A short string may live in the
+ *  nursery, a long one is allocated in the old space, where it is swept.
+ *  Literals are shared by all their occurrences, and cannot be changed.
+ */
+#define STRING_INLINE_CHARS 15
+
+class String final : public Value
 {
 public:
-    Nil() : Value(ValueType::NIL) {}
-};
+    String() : Value(ValueType::STRING) {}
+    ~String() { if (size_ > STRING_INLINE_CHARS) delete[] heap_; }
+    String(const String &) = delete;
+    String& operator=(const String &) = delete;
+
+    size_t size() const { return size_; }
+    char* data() { return size_ > STRING_INLINE_CHARS ? heap_ : inline_; }
+    const char* data() const { return size_ > STRING_INLINE_CHARS ? heap_ : inline_; }
+    std::string_view view() const { return {data(), size_}; }
+private:
+    uint32_t size_ = 0;
+    bool literal_ = false;
+    union
+    {
+        char *heap_;
+        char inline_[STRING_INLINE_CHARS + 1] = {};
+    };
 
-//---------------------------------------------------------------------------
-class Eof final : public Value
-{
-public:
-    Eof() : Value(ValueType::EOF_OBJECT) {}
+    friend class Kgc;
+    friend class Kvm;
 };
 
 //---------------------------------------------------------------------------
-template<typename T, ValueType V>
-class PrimitiveValue final : public Value
+// The name lives in the arena of the symbol table, and is nul terminated
+class Symbol final : public Value
 {
 public:
-    PrimitiveValue() : Value(V) {}
+    Symbol() : Value(ValueType::SYMBOL) {}
+    std::string_view name() const { return {value_, length_}; }
+    size_t hash() const { return hash_; }
 private:
-    T value_{};
-    
+    const char *value_ = nullptr;
+    size_t length_ = 0;
+    size_t hash_ = 0;
+
     friend class Kvm;
+    friend class SymbolTable;
 };
 
-using String    = PrimitiveValue<const char *, ValueType::STRING>;
-using Boolean   = PrimitiveValue<bool, ValueType::BOOLEAN>;
-using Symbol    = PrimitiveValue<const char *, ValueType::SYMBOL>;
-
 //---------------------------------------------------------------------------
 inline bool isBoolean(const Value *v)
 {
-    return v->type() == ValueType::BOOLEAN;
+    return (reinterpret_cast<intptr_t>(v) & ~(intptr_t(1) << IMM_BITS)) == CONST_TAG;
 }
 
 inline bool isFixnum(const Value *v)
@@ -177,60 +396,95 @@ inline bool isCharacter(const Value *v)
 
 inline bool isString(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::STRING;
+    return IS_HEAP(v) && v->type() == ValueType::STRING;
 }
 
 inline bool isCell(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::CELL;
+    return IS_PAIR(v);
+}
+
+// the type of a value that is neither a fixnum nor a character
+inline ValueType typeOf(const Value *v)
+{
+    if (IS_PAIR(v)) return ValueType::CELL;
+    if (IS_PROC(v)) return TK_PROC(v)->type();
+    if (IS_CONST(v))
+    {
+        if (v == EOF_VALUE) return ValueType::EOF_OBJECT;
+        return isBoolean(v) ? ValueType::BOOLEAN : ValueType::NIL;
+    }
+    return v->type();
 }
 
 inline bool isSymbol(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::SYMBOL;
+    return IS_HEAP(v) && v->type() == ValueType::SYMBOL;
+}
+
+inline bool isProcedure(const Value *v)
+{
+    return IS_PROC(v);
 }
 
 inline bool isPrimitiveProc(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::PRIM_PROC;
+    return IS_PROC(v) && TK_PROC(v)->type() == ValueType::PRIM_PROC;
 }
 
 inline bool isCompoundProc(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::COMP_PROC;
+    return IS_PROC(v) && TK_PROC(v)->type() == ValueType::COMP_PROC;
+}
+
+inline bool isVector(const Value *v)
+{
+    return IS_HEAP(v) && v->type() == ValueType::VECTOR;
+}
+
+inline bool isBytevector(const Value *v)
+{
+    return IS_HEAP(v) && v->type() == ValueType::BYTEVECTOR;
+}
+
+inline bool isHashTable(const Value *v)
+{
+    return IS_HEAP(v) && v->type() == ValueType::HASH_TABLE;
+}
+
+inline bool isFrame(const Value *v)
+{
+    return IS_HEAP(v) && v->type() == ValueType::FRAME;
+}
+
+inline bool isEnvironment(const Value *v)
+{
+    return IS_HEAP(v) && v->type() == ValueType::ENVIRONMENT;
 }
 
 inline bool isInputPort(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::INPUT_PORT;
+    return IS_HEAP(v) && v->type() == ValueType::INPUT_PORT;
 }
 
 inline bool isOutputPort(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::OUTPUT_PORT;
+    return IS_HEAP(v) && v->type() == ValueType::OUTPUT_PORT;
 }
 
 inline bool isEof(const Value *v)
 {
-    if (isFixnum(v) || isCharacter(v)) return false;
-    return v->type() == ValueType::EOF_OBJECT;
+    return v == EOF_VALUE;
 }
 
 inline const Value* car(const Value *v)
 {
-    return static_cast<const Cell *>(v)->head_;
+    return TK_PAIR(v)->head_;
 }
 
 inline const Value* cdr(const Value *v)
 {
-    return static_cast<const Cell *>(v)->tail_;
+    return TK_PAIR(v)->tail_;
 }
 
 inline const Value* cadr(const Value *v)
@@ -3,22 +3,27 @@
 //
 
 #include <cassert>
-#include <set>
+#include <cstring>
 #include <unordered_map>
 #include <string>
 #include <fstream>
 #include <cctype>
 #include <stdexcept>
+#include <new>
 #include <chrono>
 #include <limits>
+#include <algorithm>
 #include "kvm.h"
 #include "kvalue.h"
+#include "kbytes.h"
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::string;
 
+#define INITIAL_HASH_TABLE_SLOTS 8
+
 namespace
 {
     struct KatException : public std::runtime_error
@@ -33,8 +38,7 @@ namespace
 
     bool isInitial(char c)
     {
-        static const std::set<char> allowable { '*', '/', '>', '<', '=', '?', '!'};
-        return std::isalpha(c) || allowable.count(c);
+        return std::isalpha(c) || (c && strchr("*/><=?!", c));
     }
 
     void eatWhitespace(std::istream &in)
@@ -71,6 +75,147 @@ namespace
         }
     }
 
+    const Vector* checkVector(const Value *v)
+    {
+        if (!isVector(v))
+        {
+            throw KatException("not a vector");
+        }
+        return static_cast<const Vector *>(v);
+    }
+
+    size_t checkIndex(const Value *k, const Vector *vector)
+    {
+        if (!IS_INT(k) || TK_INT(k) < 0 || static_cast<size_t>(TK_INT(k)) >= vector->size())
+        {
+            throw KatException("vector index out of range");
+        }
+        return TK_INT(k);
+    }
+
+    // a vector holds at most UINT32_MAX elements, so its size in bytes
+    // cannot overflow
+    size_t checkVectorLength(size_t size)
+    {
+        if (size > UINT32_MAX)
+        {
+            throw KatException("invalid vector length");
+        }
+        return size;
+    }
+
+    Bytevector* checkBytevector(const Value *v)
+    {
+        if (!isBytevector(v))
+        {
+            throw KatException("not a bytevector");
+        }
+        return const_cast<Bytevector *>(static_cast<const Bytevector *>(v));
+    }
+
+    size_t checkIndex(const Value *k, const Bytevector *bytevector)
+    {
+        if (!IS_INT(k) || TK_INT(k) < 0 || static_cast<size_t>(TK_INT(k)) >= bytevector->size())
+        {
+            throw KatException("bytevector index out of range");
+        }
+        return TK_INT(k);
+    }
+
+    size_t checkBytevectorLength(const Value *k)
+    {
+        if (!IS_INT(k) || TK_INT(k) < 0 || static_cast<uintptr_t>(TK_INT(k)) > UINT32_MAX)
+        {
+            throw KatException("invalid bytevector length");
+        }
+        return TK_INT(k);
+    }
+
+    uint8_t checkByte(const Value *v)
+    {
+        if (!IS_INT(v) || TK_INT(v) < 0 || TK_INT(v) > 255)
+        {
+            throw KatException("not a byte");
+        }
+        return TK_INT(v);
+    }
+
+    // the optional start and end at argv[first], by default the whole size
+    void checkRange(int argc, const Value * const *argv, int first, size_t size, size_t &start, size_t &end)
+    {
+        start = 0;
+        end = size;
+        if (argc > first)
+        {
+            if (!IS_INT(argv[first]) || TK_INT(argv[first]) < 0)
+                throw KatException("index out of range");
+            start = TK_INT(argv[first]);
+        }
+        if (argc > first + 1)
+        {
+            if (!IS_INT(argv[first + 1]) || TK_INT(argv[first + 1]) < 0)
+                throw KatException("index out of range");
+            end = TK_INT(argv[first + 1]);
+        }
+        if (start > end || end > size)
+        {
+            throw KatException("index out of range");
+        }
+    }
+
+    String* checkString(const Value *v)
+    {
+        if (!isString(v))
+        {
+            throw KatException("not a string");
+        }
+        return const_cast<String *>(static_cast<const String *>(v));
+    }
+
+    size_t checkIndex(const Value *k, const String *string)
+    {
+        if (!IS_INT(k) || TK_INT(k) < 0 || static_cast<size_t>(TK_INT(k)) >= string->size())
+        {
+            throw KatException("string index out of range");
+        }
+        return TK_INT(k);
+    }
+
+    // the size of a string is kept in 32 bits
+    size_t checkLength(size_t size)
+    {
+        if (size > UINT32_MAX)
+        {
+            throw KatException("string too long");
+        }
+        return size;
+    }
+
+    HashTable* checkHashTable(const Value *v)
+    {
+        if (!isHashTable(v))
+        {
+            throw KatException("not a hash table");
+        }
+        return const_cast<HashTable *>(static_cast<const HashTable *>(v));
+    }
+
+    // symbols keep the hash of their name, anything else hashes its bits
+    size_t hashOf(const Value *key)
+    {
+        if (isSymbol(key)) return static_cast<const Symbol *>(key)->hash();
+        uint64_t h = reinterpret_cast<uintptr_t>(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    bool isHashedByAddress(const Value *key)
+    {
+        return !IS_IMMEDIATE(key) && !isSymbol(key);
+    }
+
     void peekExpectedDelimiter(std::istream &in)
     {
         if (!isDelimiter(in.peek())) // FIXME: peek returns int
@@ -81,47 +226,34 @@ namespace
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::makeFuncApplication(const Value *op, const Value *operands)
+const Value* Kvm::makeString(std::string_view str)
 {
-    return makeCell(op, operands);
+    String *s = gc_.allocString(checkLength(str.size()));
+    memcpy(s->data(), str.data(), str.size());
+    s->data()[str.size()] = '\0';
+    return s;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::makeString(const std::string& str)
+// equal literals share a string, for as long as one of them is alive
+const Value* Kvm::internString(const std::string& str)
 {
     auto iter = interned_strings.find(str);
     if (iter != interned_strings.end())
     {
-        return iter->second;
+        return gc_.readWeak(iter->second);
     } else
     {
-        String *s = static_cast<String *>(gc_.allocValue(ValueType::STRING));
-        auto r = interned_strings.insert({str, s});
-        s->value_ = r.first->first.c_str();
-        gc_.pushStackRoot(s);
+        // the table points to it, so it must not move
+        String *s = gc_.allocOldString(checkLength(str.size()));
+        memcpy(s->data(), str.data(), str.size());
+        s->data()[str.size()] = '\0';
+        s->literal_ = true;
+        interned_strings.insert({str, s});
         return s;
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::makeIf(const Value *pred, const Value *conseq, const Value *alternate)
-{
-    const Value *result = nullptr;
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result);
-    result = makeCell(alternate, NIL);
-    result = makeCell(conseq, result);
-    result = makeCell(pred, result);
-    result = makeCell(IF, result);
-    return result;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::makeBegin(const Value *v)
-{
-    return makeCell(BEGIN, v);
-}
-
 bool Kvm::isBegin(const Value *v)
 {
     return isTagged(v, BEGIN);
@@ -132,28 +264,13 @@ const Value* Kvm::beginActions(const Value *v)
     return cdr(v);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::makeBool(bool condition)
-{
-    Boolean *b = static_cast<Boolean *>(gc_.allocValue(ValueType::BOOLEAN));
-    b->value_ = condition;
-    return b;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 const Value* Kvm::makeCell(const Value *first, const Value *second)
 {
-    Cell *c = static_cast<Cell *>(gc_.allocValue(ValueType::CELL));
+    Cell *c = gc_.allocCell();
     c->head_ = first;
     c->tail_ = second;
-    return c;
-}
-
-const Value* Kvm::makeEofObject()
-{
-    Value *v = gc_.allocValue(ValueType::EOF_OBJECT);
-    v->type_ = ValueType::EOF_OBJECT;
-    return v;
+    return MK_PAIR(c);
 }
 
 const Value* Kvm::makeInputPort(std::unique_ptr<std::ifstream> input)
@@ -170,18 +287,16 @@ const Value* Kvm::makeOutputPort(std::unique_ptr<std::ofstream> output)
     return op;
 }
 
-const Value*Kvm::makeSymbol(const std::string &str)
+const Value* Kvm::makeSymbol(std::string_view str)
 {
-    auto iter = symbols.find(str);
-    if (iter != symbols.end())
+    auto hash = SymbolTable::hash(str);
+    if (Symbol *s = symbols.find(str, hash))
     {
-        return iter->second;
+        return gc_.readWeak(s);
     } else
     {
-        Symbol *s = static_cast<Symbol *>(gc_.allocValue(ValueType::SYMBOL));
-        auto r = symbols.insert({str, s});
-        s->value_ = r.first->first.c_str();
-        gc_.pushStackRoot(s);
+        s = static_cast<Symbol *>(gc_.allocValue(ValueType::SYMBOL));
+        symbols.insert(s, str, hash);
         return s;
     }
 }
@@ -198,138 +313,160 @@ const Value *Kvm::makeChar(char c)
     return reinterpret_cast<Value *>(MK_CHR(c));
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value*Kvm::makeNil()
-{
-    return gc_.allocValue(ValueType::NIL); /* nil by default */
-}
 
-const Value* Kvm::makeProc(const Value *(proc)(Kvm *vm, const Value *args))
+const Value* Kvm::makeProc(PrimitiveFunc proc, int minArgs, int maxArgs)
 {
     PrimitiveProc *v = static_cast<PrimitiveProc *>(gc_.allocValue(ValueType::PRIM_PROC));
     v->func_ = proc;
-    return v;
+    v->minArgs_ = minArgs;
+    v->maxArgs_ = maxArgs;
+    return MK_PROC(v);
 }
 
-const Value* Kvm::makeCompoundProc(const Value* parameters, const Value* body, const Value* env)
+const Value* Kvm::makeCompoundProc(const Value* code, const Value* env)
 {
     CompoundProc *cp = static_cast<CompoundProc *>(gc_.allocValue(ValueType::COMP_PROC));
 
-    cp->parameters_ = parameters;
-    cp->body_ = body;
+    cp->code_ = code;
     cp->env_ = env;
-    return cp;
+    return MK_PROC(cp);
 }
 
-const Value* Kvm::makeLambda(const Value* parameters, const Value* body)
+const Value* Kvm::makeCode()
 {
-    const Value *result = nullptr;
-    gc_.pushLocalStackRoot(&result);
-    
-    result = makeCell(parameters, body);
-    result = makeCell(LAMBDA, result);
-    
-    gc_.popLocalStackRoot();
-    return result;
+    Code *code = static_cast<Code *>(gc_.allocValue(ValueType::CODE));
+    code->clear();
+    code->variables_ = NIL_VALUE;
+    return code;
 }
 
 const Value* Kvm::makeEnvironment()
 {
-    const Value *env = nullptr;
-    gc_.pushLocalStackRoot(&env);
-    
-    env = setupEnvironment();
+    const Value *env = setupEnvironment();
     populateEnvironment(const_cast<Value *>(env));
     
-    gc_.popLocalStackRoot();
     return env;
 }
 
-void Kvm::addEnvProc(Value *env, const char *schemeName, const Value * (*proc)(Kvm *vm, const Value *))
+void Kvm::addEnvProc(Value *env, const char *schemeName, PrimitiveFunc proc, int minArgs, int maxArgs)
 {
-    const Value *result1 = nullptr;
-    const Value *result2 = nullptr;
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result1);
-    guard.pushLocalStackRoot(&result2);
-    result2 = makeProc(proc);
-    result1 = makeSymbol(schemeName);
-    defineVariable(result1, result2, env);
+    const Value *procedure = makeProc(proc, minArgs, maxArgs);
+    defineVariable(makeSymbol(schemeName), procedure, env);
 }
 
 void Kvm::populateEnvironment(Value *env)
 {
-    addEnvProc(env, "null?", isNullP);
-    addEnvProc(env, "boolean?", isBoolP);
-    addEnvProc(env, "symbol?", isSymbolP);
-    addEnvProc(env, "integer?", isIntegerP);
-    addEnvProc(env, "char?", isCharP);
-    addEnvProc(env, "string?", isStringP);
-    addEnvProc(env, "pair?", isPairP);
-    addEnvProc(env, "procedure?", isProcedureP);
-
-    addEnvProc(env, "char->integer", charToInteger);
-    addEnvProc(env, "integer->char", integerToChar);
-    addEnvProc(env, "number->string", numberToString);
-    addEnvProc(env, "string->number", stringToNumber);
-    addEnvProc(env, "symbol->string", symbolToString);
-    addEnvProc(env, "string->symbol", stringToSymbol);
-
-    addEnvProc(env, "+", addProc);
-    addEnvProc(env, "-", subProc);
-    addEnvProc(env, "*", mulProc);
-    addEnvProc(env, "quotient", quotientProc);
-    addEnvProc(env, "remainder", remainderProc);
-    addEnvProc(env, "=", isNumberEqualProc);
-    addEnvProc(env, "<", isLessThanProc);
-    addEnvProc(env, ">", isGreaterThanProc);
-    addEnvProc(env, "cons", consProc);
-    addEnvProc(env, "car" , carProc);
-    addEnvProc(env, "cdr" , cdrProc);
-    addEnvProc(env, "set-car!", setCarProc);
-    addEnvProc(env, "set-cdr!", setCdrProc);
-    addEnvProc(env, "list", listProc);
-    addEnvProc(env, "eq?", isEqProc);
-    addEnvProc(env, "apply", applyProc);
-    addEnvProc(env, "interaction-environment", interactionEnvironmentProc);
-    addEnvProc(env, "null-environment", nullEnvironmentProc);
-    addEnvProc(env, "environment", environmentProc);
-    addEnvProc(env, "eval", evalProc);
-
-    addEnvProc(env, "load", loadProc);
-    addEnvProc(env, "open-input-port", openInputPortProc);
-    addEnvProc(env, "close-input-port", closeInputPortProc);
-    addEnvProc(env, "input-port?", isInputPortProc);
-
-    addEnvProc(env, "open-output-port", openOutputPortProc);
-    addEnvProc(env, "close-output-port", closeOutputPortProc);
-    addEnvProc(env, "output-port?", isOutputPortProc);
-
-    addEnvProc(env, "read", readProc);
-    addEnvProc(env, "read-char", readCharProc);
-    addEnvProc(env, "peek-char", peekCharProc);
-    addEnvProc(env, "write", writeProc);
-    addEnvProc(env, "write-char", writeCharProc);
-    addEnvProc(env, "display", displayProc);
-
-    addEnvProc(env, "eof-object?", isEofObjectProc);
-    addEnvProc(env, "error", errorProc);
+    addEnvProc(env, "null?", isNullP, 1, 1);
+    addEnvProc(env, "boolean?", isBoolP, 1, 1);
+    addEnvProc(env, "symbol?", isSymbolP, 1, 1);
+    addEnvProc(env, "integer?", isIntegerP, 1, 1);
+    addEnvProc(env, "char?", isCharP, 1, 1);
+    addEnvProc(env, "string?", isStringP, 1, 1);
+    addEnvProc(env, "pair?", isPairP, 1, 1);
+    addEnvProc(env, "procedure?", isProcedureP, 1, 1);
+
+    addEnvProc(env, "char->integer", charToInteger, 1, 1);
+    addEnvProc(env, "integer->char", integerToChar, 1, 1);
+    addEnvProc(env, "number->string", numberToString, 1, 1);
+    addEnvProc(env, "string->number", stringToNumber, 1, 1);
+    addEnvProc(env, "symbol->string", symbolToString, 1, 1);
+    addEnvProc(env, "string->symbol", stringToSymbol, 1, 1);
+    addEnvProc(env, "make-string", makeStringProc, 1, 2);
+    addEnvProc(env, "string=?", isStringEqualProc, 1, VARIADIC);
+    addEnvProc(env, "string-length", stringLengthProc, 1, 1);
+    addEnvProc(env, "string-ref", stringRefProc, 2, 2);
+    addEnvProc(env, "string-set!", stringSetProc, 3, 3);
+    addEnvProc(env, "substring", substringProc, 2, 3);
+    addEnvProc(env, "string-append", stringAppendProc, 0, VARIADIC);
+
+    addEnvProc(env, "+", addProc, 0, VARIADIC);
+    addEnvProc(env, "-", subProc, 1, VARIADIC);
+    addEnvProc(env, "*", mulProc, 0, VARIADIC);
+    addEnvProc(env, "quotient", quotientProc, 2, 2);
+    addEnvProc(env, "remainder", remainderProc, 2, 2);
+    addEnvProc(env, "=", isNumberEqualProc, 1, VARIADIC);
+    addEnvProc(env, "<", isLessThanProc, 1, VARIADIC);
+    addEnvProc(env, ">", isGreaterThanProc, 1, VARIADIC);
+    addEnvProc(env, "cons", consProc, 2, 2);
+    addEnvProc(env, "car" , carProc, 1, 1);
+    addEnvProc(env, "cdr" , cdrProc, 1, 1);
+    addEnvProc(env, "set-car!", setCarProc, 2, 2);
+    addEnvProc(env, "set-cdr!", setCdrProc, 2, 2);
+    addEnvProc(env, "list", listProc, 0, VARIADIC);
+    addEnvProc(env, "vector?", isVectorP, 1, 1);
+    addEnvProc(env, "make-vector", makeVectorProc, 1, 2);
+    addEnvProc(env, "vector", vectorProc, 0, VARIADIC);
+    addEnvProc(env, "vector-length", vectorLengthProc, 1, 1);
+    addEnvProc(env, "vector-ref", vectorRefProc, 2, 2);
+    addEnvProc(env, "vector-set!", vectorSetProc, 3, 3);
+    addEnvProc(env, "vector-fill!", vectorFillProc, 2, 2);
+    addEnvProc(env, "vector->list", vectorToListProc, 1, 1);
+    addEnvProc(env, "list->vector", listToVectorProc, 1, 1);
+    addEnvProc(env, "bytevector?", isBytevectorP, 1, 1);
+    addEnvProc(env, "make-bytevector", makeBytevectorProc, 1, 2);
+    addEnvProc(env, "bytevector", bytevectorProc, 0, VARIADIC);
+    addEnvProc(env, "bytevector-length", bytevectorLengthProc, 1, 1);
+    addEnvProc(env, "bytevector-u8-ref", bytevectorRefProc, 2, 2);
+    addEnvProc(env, "bytevector-u8-set!", bytevectorSetProc, 3, 3);
+    addEnvProc(env, "bytevector-copy", bytevectorCopyProc, 1, 3);
+    addEnvProc(env, "bytevector-copy!", bytevectorCopyToProc, 3, 5);
+    addEnvProc(env, "bytevector-append", bytevectorAppendProc, 0, VARIADIC);
+    addEnvProc(env, "bytevector=?", isBytevectorEqualProc, 2, 2);
+    addEnvProc(env, "hash-table?", isHashTableP, 1, 1);
+    addEnvProc(env, "make-hash-table", makeHashTableProc, 0, 0);
+    addEnvProc(env, "hash-table-ref", hashTableRefProc, 2, 3);
+    addEnvProc(env, "hash-table-ref/default", hashTableRefDefaultProc, 3, 3);
+    addEnvProc(env, "hash-table-set!", hashTableSetProc, 3, 3);
+    addEnvProc(env, "hash-table-delete!", hashTableDeleteProc, 2, 2);
+    addEnvProc(env, "hash-table-contains?", hashTableContainsProc, 2, 2);
+    addEnvProc(env, "hash-table-count", hashTableCountProc, 1, 1);
+    addEnvProc(env, "hash-table-walk", hashTableWalkProc, 2, 2);
+    addEnvProc(env, "eq?", isEqProc, 2, 2);
+    addEnvProc(env, "equal?", isEqualProc, 2, 2);
+    addEnvProc(env, "apply", applyProc, 2, VARIADIC);
+    addEnvProc(env, "interaction-environment", interactionEnvironmentProc, 0, 0);
+    addEnvProc(env, "null-environment", nullEnvironmentProc, 0, 1);
+    addEnvProc(env, "environment", environmentProc, 0, VARIADIC);
+    addEnvProc(env, "eval", evalProc, 2, 2);
+
+    addEnvProc(env, "load", loadProc, 1, 1);
+    addEnvProc(env, "open-input-port", openInputPortProc, 1, 1);
+    addEnvProc(env, "close-input-port", closeInputPortProc, 1, 1);
+    addEnvProc(env, "input-port?", isInputPortProc, 1, 1);
+
+    addEnvProc(env, "open-output-port", openOutputPortProc, 1, 1);
+    addEnvProc(env, "close-output-port", closeOutputPortProc, 1, 1);
+    addEnvProc(env, "output-port?", isOutputPortProc, 1, 1);
+
+    addEnvProc(env, "read", readProc, 0, 1);
+    addEnvProc(env, "read-char", readCharProc, 0, 1);
+    addEnvProc(env, "peek-char", peekCharProc, 0, 1);
+    addEnvProc(env, "read-bytevector", readBytevectorProc, 1, 2);
+    addEnvProc(env, "read-bytevector!", readBytevectorToProc, 1, 4);
+    addEnvProc(env, "write-bytevector", writeBytevectorProc, 1, 4);
+    addEnvProc(env, "write", writeProc, 1, 2);
+    addEnvProc(env, "write-char", writeCharProc, 1, 2);
+    addEnvProc(env, "display", displayProc, 1, 2);
+
+    addEnvProc(env, "eof-object?", isEofObjectProc, 1, 1);
+    addEnvProc(env, "error", errorProc, 0, VARIADIC);
 
     // utilities
-    addEnvProc(env, "current-time-millis", currentTimeMillisProc);
+    addEnvProc(env, "current-time-millis", currentTimeMillisProc, 0, 0);
 }
 
 void Kvm::displayCell(const Value *v, std::ostream &out)
 {
     displayValue(car(v), out);
-    if (isCell(cdr(v)))
+    for (v = cdr(v); isCell(v); v = cdr(v))
     {
         out << ' ';
-        displayCell(cdr(v), out);
-    } else if (cdr(v) != NIL)
+        displayValue(car(v), out);
+    }
+    if (v != NIL_VALUE)
     {
         out << " . ";
-        displayValue(cdr(v), out);
+        displayValue(v, out);
     }
 }
 
@@ -343,22 +480,38 @@ void Kvm::displayValue(const Value *v, std::ostream &out)
         out << TK_CHR(v);
     } else 
     {
-        switch (v->type())
+        switch (typeOf(v))
         {
             case ValueType::BOOLEAN:
-                out << (static_cast<const Boolean *>(v)->value_ ? "#t" : "#f");
+                out << (v == TRUE_VALUE ? "#t" : "#f");
                 break;
             case ValueType::STRING:
-                out << (static_cast<const String *>(v)->value_);
+                out << static_cast<const String *>(v)->view();
                 break;
             case ValueType::SYMBOL:
-                out << (static_cast<const String *>(v)->value_);
+                out << (static_cast<const Symbol *>(v)->value_);
                 break;
             case ValueType::CELL:
                 out << '(';
                 displayCell(v, out);
                 out << ')';
                 break;
+            case ValueType::VECTOR:
+            {
+                auto vector = static_cast<const Vector *>(v);
+                out << "#(";
+                for (size_t i = 0; i != vector->size_; ++i)
+                {
+                    if (i) out << ' ';
+                    displayValue(vector->elements_[i], out);
+                }
+                out << ')';
+                break;
+            }
+            case ValueType::BYTEVECTOR:
+            case ValueType::HASH_TABLE:
+                print(v, out);
+                break;
             default:
                 out << "`display` primitive is not implemented for this object";
                 break;
@@ -366,456 +519,972 @@ void Kvm::displayValue(const Value *v, std::ostream &out)
     }
 }
 
-const Value* Kvm::isNullP(Kvm *vm, const Value *args)
+const Value* Kvm::isNullP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return car(args) == vm->NIL ? vm->TRUE : vm->FALSE;
+    return argv[0] == NIL_VALUE ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isBoolP(Kvm *vm, const Value *args)
+const Value* Kvm::isBoolP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isBoolean(car(args)) ? vm->TRUE : vm->FALSE;
+    return isBoolean(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isSymbolP(Kvm *vm, const Value *args)
+const Value* Kvm::isSymbolP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isSymbol(car(args)) ? vm->TRUE : vm->FALSE;
+    return isSymbol(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isIntegerP(Kvm *vm, const Value *args)
+const Value* Kvm::isIntegerP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isFixnum(car(args)) ? vm->TRUE : vm->FALSE;
+    return isFixnum(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
 
-const Value* Kvm::isCharP(Kvm *vm, const Value *args)
+const Value* Kvm::isCharP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isCharacter(car(args)) ? vm->TRUE : vm->FALSE;
+    return isCharacter(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isStringP(Kvm *vm, const Value *args)
+const Value* Kvm::isStringP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isString(car(args)) ? vm->TRUE : vm->FALSE;
+    return isString(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isPairP(Kvm *vm, const Value *args)
+const Value* Kvm::isPairP(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isCell(car(args)) ? vm->TRUE : vm->FALSE;
+    return isCell(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::isProcedureP(Kvm *vm, const Value *args)
+const Value* Kvm::isProcedureP(Kvm *vm, int argc, const Value * const *argv)
 {
-    auto obj = car(args);
-    return isPrimitiveProc(obj) || isCompoundProc(obj) ? vm->TRUE : vm->FALSE;
+    return isProcedure(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::charToInteger(Kvm *vm, const Value *args)
+const Value* Kvm::charToInteger(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->makeFixnum(TK_CHR(car(args)));
+    return vm->makeFixnum(TK_CHR(argv[0]));
 }
 
-const Value* Kvm::integerToChar(Kvm *vm, const Value *args)
+const Value* Kvm::integerToChar(Kvm *vm, int argc, const Value * const *argv)
 {
-    long n = TK_INT(car(args));
+    long n = TK_INT(argv[0]);
     return vm->makeChar(n);
 }
 
-const Value* Kvm::numberToString(Kvm *vm, const Value *args)
+const Value* Kvm::numberToString(Kvm *vm, int argc, const Value * const *argv)
 {
-    long n = TK_INT(car(args));
+    long n = TK_INT(argv[0]);
     return vm->makeString(std::to_string(n));
 }
 
-const Value* Kvm::stringToNumber(Kvm *vm, const Value *args)
+const Value* Kvm::stringToNumber(Kvm *vm, int argc, const Value * const *argv)
+{
+    const String *s = static_cast<const String *>(argv[0]);
+    return vm->makeFixnum(std::stol(s->data()));
+}
+
+const Value* Kvm::symbolToString(Kvm *vm, int argc, const Value * const *argv)
+{
+    const Symbol *s = static_cast<const Symbol *>(argv[0]);
+    return vm->makeString(s->name());
+}
+
+const Value* Kvm::stringToSymbol(Kvm *vm, int argc, const Value * const *argv)
+{
+    const String *s = static_cast<const String *>(argv[0]);
+    return vm->makeSymbol(s->view());
+}
+
+const Value* Kvm::makeStringProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    if (!IS_INT(argv[0]) || TK_INT(argv[0]) < 0)
+    {
+        throw KatException("invalid string length");
+    }
+    if (argc == 2 && !IS_CHR(argv[1]))
+    {
+        throw KatException("not a character");
+    }
+    size_t size = checkLength(TK_INT(argv[0]));
+    String *s = vm->gc_.allocString(size);
+    memset(s->data(), argc == 2 ? TK_CHR(argv[1]) : ' ', size);
+    s->data()[size] = '\0';
+    return s;
+}
+
+const Value* Kvm::isStringEqualProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto first = checkString(argv[0])->view();
+    for (int i = 1; i != argc; ++i)
+    {
+        if (checkString(argv[i])->view() != first) return FALSE_VALUE;
+    }
+    return TRUE_VALUE;
+}
+
+const Value* Kvm::stringLengthProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->makeFixnum(checkString(argv[0])->size());
+}
+
+const Value* Kvm::stringRefProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto s = checkString(argv[0]);
+    return vm->makeChar(s->data()[checkIndex(argv[1], s)]);
+}
+
+// the chars are not pointers, so no barriers
+const Value* Kvm::stringSetProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const String *s = static_cast<const String *>(car(args));
-    return vm->makeFixnum(std::stol(s->value_));
+    auto s = checkString(argv[0]);
+    auto i = checkIndex(argv[1], s);
+    if (!IS_CHR(argv[2]))
+    {
+        throw KatException("not a character");
+    }
+    if (s->literal_)
+    {
+        throw KatException("string literals cannot be changed");
+    }
+    s->data()[i] = TK_CHR(argv[2]);
+    return vm->OK;
 }
 
-const Value* Kvm::symbolToString(Kvm *vm, const Value *args)
+// (substring string start [end])
+const Value* Kvm::substringProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const Symbol *s = static_cast<const Symbol *>(car(args));
-    return vm->makeString(s->value_);
+    auto s = checkString(argv[0]);
+    size_t start, end;
+    checkRange(argc, argv, 1, s->size(), start, end);
+    return vm->makeString(s->view().substr(start, end - start));
 }
 
-const Value* Kvm::stringToSymbol(Kvm *vm, const Value *args)
+const Value* Kvm::stringAppendProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const String *s = static_cast<const String *>(car(args));
-    return vm->makeSymbol(s->value_);
+    size_t size = 0;
+    for (int i = 0; i != argc; ++i)
+        size += checkString(argv[i])->size();
+
+    String *result = vm->gc_.allocString(checkLength(size));
+    char *top = result->data();
+    for (int i = 0; i != argc; ++i)
+    {
+        auto s = static_cast<const String *>(argv[i]);
+        memcpy(top, s->data(), s->size());
+        top += s->size();
+    }
+    *top = '\0';
+    return result;
 }
 
-const Value* Kvm::addProc(Kvm *vm, const Value *args)
+const Value* Kvm::addProc(Kvm *vm, int argc, const Value * const *argv)
 {
     long result {0};
     
-    while (args != vm->NIL)
+    for (int i = 0; i != argc; ++i)
     {
-        result += TK_INT(car(args));
-        args = cdr(args);
+        result += TK_INT(argv[i]);
     }
     return vm->makeFixnum(result);
 }
 
 
-const Value* Kvm::subProc(Kvm *vm, const Value *args)
+const Value* Kvm::subProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    long result = TK_INT(car(args));
+    long result = TK_INT(argv[0]);
     
-    while ((args = cdr(args)) != vm->NIL)
+    if (argc == 1)
+    {
+        return vm->makeFixnum(-result);
+    }
+    for (int i = 1; i != argc; ++i)
     {
-        result -= TK_INT(car(args));
+        result -= TK_INT(argv[i]);
     }
     
     return vm->makeFixnum(result);
 }
 
-const Value* Kvm::mulProc(Kvm *vm, const Value *args)
+const Value* Kvm::mulProc(Kvm *vm, int argc, const Value * const *argv)
 {
     long result = 1;
     
-    while (args != vm->NIL)
+    for (int i = 0; i != argc; ++i)
     {
-        result *= TK_INT(car(args));
-        args = cdr(args);
+        result *= TK_INT(argv[i]);
     }
     
     return vm->makeFixnum(result);
 }
 
 
-const Value* Kvm::quotientProc(Kvm *vm, const Value *args)
+const Value* Kvm::quotientProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->makeFixnum(TK_INT(car(args)) / TK_INT(cadr(args)));
+    return vm->makeFixnum(TK_INT(argv[0]) / TK_INT(argv[1]));
 }
 
-const Value* Kvm::remainderProc(Kvm *vm, const Value *args)
+const Value* Kvm::remainderProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->makeFixnum(TK_INT(car(args)) % TK_INT(cadr(args)));
+    return vm->makeFixnum(TK_INT(argv[0]) % TK_INT(argv[1]));
 }
 
-const Value* Kvm::isNumberEqualProc(Kvm *vm, const Value *args)
+const Value* Kvm::isNumberEqualProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    long value = TK_INT(car(args));
-    while ((args = cdr(args)) != vm->NIL)
+    long value = TK_INT(argv[0]);
+    for (int i = 1; i != argc; ++i)
     {
-        if (value != TK_INT(car(args))) return vm->FALSE;
+        if (value != TK_INT(argv[i])) return FALSE_VALUE;
     }
-    return vm->TRUE;
+    return TRUE_VALUE;
 }
 
-const Value* Kvm::isLessThanProc(Kvm *vm, const Value *args)
+const Value* Kvm::isLessThanProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    long previous = TK_INT(car(args));
-    while ((args = cdr(args)) != vm->NIL)
+    for (int i = 1; i != argc; ++i)
     {
-        long next = TK_INT(car(args));
-        if (previous < next)
-        {
-            previous = next;
-        } else
-        {
-            return vm->FALSE;
-        }
+        if (!(TK_INT(argv[i - 1]) < TK_INT(argv[i]))) return FALSE_VALUE;
     }
-    return vm->TRUE;
+    return TRUE_VALUE;
 }
 
-const Value* Kvm::isGreaterThanProc(Kvm *vm, const Value *args)
+const Value* Kvm::isGreaterThanProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    long previous = TK_INT(car(args));
-    while ((args = cdr(args)) != vm->NIL)
+    for (int i = 1; i != argc; ++i)
     {
-        long next = TK_INT(car(args));
-        if (previous > next)
-        {
-            previous = next;
-        } else
-        {
-            return vm->FALSE;
-        }
+        if (!(TK_INT(argv[i - 1]) > TK_INT(argv[i]))) return FALSE_VALUE;
     }
-    return vm->TRUE;
+    return TRUE_VALUE;
 }
 
-const Value* Kvm::consProc(Kvm *vm, const Value *args)
+const Value* Kvm::consProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->makeCell(car(args), cadr(args));
+    return vm->makeCell(argv[0], argv[1]);
 }
 
-const Value* Kvm::carProc(Kvm *vm, const Value *args)
+const Value* Kvm::carProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return car(car(args));
+    return car(argv[0]);
 }
 
-const Value* Kvm::cdrProc(Kvm *vm, const Value *args)
+const Value* Kvm::cdrProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return cdr(car(args));
+    return cdr(argv[0]);
 }
 
-const Value* Kvm::setCarProc(Kvm *vm, const Value *args)
+const Value* Kvm::setCarProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    set_car(const_cast<Value *>(car(args)), cadr(args));
+    vm->gc_.snapshotBarrier(car(argv[0]));
+    set_car(const_cast<Value *>(argv[0]), argv[1]);
+    vm->gc_.writeBarrier(argv[0], argv[1]);
     return vm->OK;
 }
 
-const Value* Kvm::setCdrProc(Kvm *vm, const Value *args)
+const Value* Kvm::setCdrProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    set_cdr(const_cast<Value *>(car(args)), cadr(args));
+    vm->gc_.snapshotBarrier(cdr(argv[0]));
+    set_cdr(const_cast<Value *>(argv[0]), argv[1]);
+    vm->gc_.writeBarrier(argv[0], argv[1]);
     return vm->OK;
 }
 
-const Value* Kvm::listProc(Kvm *vm, const Value *args)
+const Value* Kvm::listProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return args;
+    const Value *result = NIL_VALUE;
+    for (int i = argc; i != 0; --i)
+    {
+        result = vm->makeCell(argv[i - 1], result);
+    }
+    return result;
 }
 
-const Value* Kvm::isEqProc(Kvm *vm, const Value *args)
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::makeVector(size_t size, const Value *fill)
 {
-    auto obj1 = car(args);
-    auto obj2 = cadr(args);
+    Vector *vector = gc_.allocVector(checkVectorLength(size));
+    std::fill(vector->elements_, vector->elements_ + size, fill);
+    return vector;
+}
 
-    if (IS_INT(obj1) && IS_INT(obj2))
-    {
-        return TK_INT(obj1) == TK_INT(obj2) ? vm->TRUE : vm->FALSE;
-    } else if (IS_CHR(obj1) && IS_CHR(obj2))
-    {
-        return TK_CHR(obj1) == TK_CHR(obj2) ? vm->TRUE : vm->FALSE;
-    } else if (IS_INT(obj1) || IS_INT(obj2))
+const Value* Kvm::listToVector(const Value *list)
+{
+    size_t size = 0;
+    const Value *v = list;
+    for (; isCell(v); v = cdr(v))
+        ++size;
+    if (v != NIL_VALUE)
     {
-        return vm->FALSE;
-    } else if (IS_CHR(obj1) || IS_CHR(obj2)) {
-        return vm->FALSE;
+        throw KatException("not a proper list");
     }
 
-    if (obj1->type() != obj2->type())
-    {
-        return vm->FALSE;
-    }
-    switch (obj1->type())
-    {
-        case ValueType::STRING:
-        {
-            const String *s1 = static_cast<const String *>(obj1);
-            const String *s2 = static_cast<const String *>(obj2);
-            return s1->value_ == s2->value_ ? vm->TRUE : vm->FALSE;
-        }
-        default:
-            return obj1 == obj2 ? vm->TRUE : vm->FALSE;
-    }
+    Vector *vector = gc_.allocVector(checkVectorLength(size));
+    for (size_t i = 0; i != size; ++i, list = cdr(list))
+        vector->elements_[i] = car(list);
+    return vector;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::applyProc(Kvm *vm, const Value *args)
+const Value* Kvm::isVectorP(Kvm *vm, int argc, const Value * const *argv)
 {
-    cerr << "illegal state: The body of the apply primitive procedure should not execute." << endl;
-    exit(-1);
+    return isVector(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::interactionEnvironmentProc(Kvm *vm, const Value *arguments)
+const Value* Kvm::makeVectorProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->GLOBAL_ENV;
+    if (!IS_INT(argv[0]) || TK_INT(argv[0]) < 0)
+    {
+        throw KatException("invalid vector length");
+    }
+    return vm->makeVector(TK_INT(argv[0]), argc == 2 ? argv[1] : FALSE_VALUE);
 }
 
-const Value* Kvm::nullEnvironmentProc(Kvm *vm, const Value *args)
+const Value* Kvm::vectorProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->setupEnvironment();
+    Vector *vector = vm->gc_.allocVector(checkVectorLength(argc));
+    std::copy(argv, argv + argc, vector->elements_);
+    return vector;
 }
 
-const Value* Kvm::environmentProc(Kvm *vm, const Value *args)
+const Value* Kvm::vectorLengthProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return vm->makeEnvironment();
+    return vm->makeFixnum(checkVector(argv[0])->size());
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::evalProc(Kvm *vm, const Value *args)
+const Value* Kvm::vectorRefProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    cerr << "illegal state: The body of the eval primitive procedure should not execute" << endl;
-    exit(-1);
+    auto vector = checkVector(argv[0]);
+    return vector->elements_[checkIndex(argv[1], vector)];
 }
 
-const Value* Kvm::evalExpression(const Value *arguments)
+const Value* Kvm::vectorSetProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return car(arguments);
+    auto vector = const_cast<Vector *>(checkVector(argv[0]));
+    auto i = checkIndex(argv[1], vector);
+    vm->gc_.snapshotBarrier(vector->elements_[i]);
+    storeField(vector->elements_[i], argv[2]);
+    vm->gc_.writeBarrier(vector, argv[2]);
+    return vm->OK;
 }
 
-const Value* Kvm::evalEnvironment(const Value *arguments)
+const Value* Kvm::vectorFillProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return cadr(arguments);
+    auto vector = const_cast<Vector *>(checkVector(argv[0]));
+    for (size_t i = 0; i != vector->size_; ++i)
+    {
+        vm->gc_.snapshotBarrier(vector->elements_[i]);
+        storeField(vector->elements_[i], argv[1]);
+    }
+    vm->gc_.writeBarrier(vector, argv[1]);
+    return vm->OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::loadProc(Kvm *vm, const Value *args)
+const Value* Kvm::vectorToListProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const String *s = static_cast<const String *>(car(args));
-    auto filename = s->value_;
-
-    std::ifstream in(filename);
-
-    if (!in)
+    auto vector = checkVector(argv[0]);
+    const Value *result = NIL_VALUE;
+    for (size_t i = vector->size_; i != 0; --i)
     {
-        std::string msg("could not load file \"");
-        msg.append(filename);
-        msg.append("\"");
-        throw KatException(msg);
+        result = vm->makeCell(vector->elements_[i - 1], result);
     }
+    return result;
+}
 
-    const Value *v = nullptr;
-    const Value *result = nullptr;
+const Value* Kvm::listToVectorProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->listToVector(argv[0]);
+}
 
-    in.unsetf(std::ios_base::skipws);
-    while ((v = vm->read(in)) && in)
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::listToBytevector(const Value *list)
+{
+    size_t size = 0;
+    const Value *v = list;
+    for (; isCell(v); v = cdr(v))
+        ++size;
+    if (v != NIL_VALUE)
     {
-        result = vm->eval(v, vm->GLOBAL_ENV);
-        if (!result) return nullptr;
+        throw KatException("not a proper list");
     }
-    return result;
+
+    Bytevector *bytevector = gc_.allocBytevector(size);
+    for (size_t i = 0; i != size; ++i, list = cdr(list))
+        bytevector->bytes_[i] = checkByte(car(list));
+    return bytevector;
 }
 
-const Value* Kvm::openInputPortProc(Kvm *vm, const Value *args)
+const Value* Kvm::isBytevectorP(Kvm *vm, int argc, const Value * const *argv)
 {
-    const String *s = static_cast<const String *>(car(args));
-    auto filename = s->value_;
-    
-    std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(filename);
-    if (!in)
-    {
-        std::string msg;
-        msg.append("could not open file \"");
-        msg.append(filename);
-        msg.append("\"");
-        throw KatException(msg);
-    }
-    return vm->makeInputPort(std::move(in));
+    return isBytevector(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::closeInputPortProc(Kvm *vm, const Value *args)
+const Value* Kvm::makeBytevectorProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const InputPort *op = static_cast<const InputPort *>(car(args));
-    op->input->close();
-    return vm->OK;
+    size_t size = checkBytevectorLength(argv[0]);
+    uint8_t fill = argc == 2 ? checkByte(argv[1]) : 0;
+    Bytevector *bytevector = vm->gc_.allocBytevector(size);
+    bytes::fill(bytevector->bytes_, fill, bytevector->size_);
+    return bytevector;
 }
 
-const Value* Kvm::isInputPortProc(Kvm *vm, const Value *args)
+const Value* Kvm::bytevectorProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isInputPort(car(args)) ? vm->TRUE : vm->FALSE;
+    Bytevector *bytevector = vm->gc_.allocBytevector(argc);
+    std::transform(argv, argv + argc, bytevector->bytes_, checkByte);
+    return bytevector;
 }
 
-const Value* Kvm::openOutputPortProc(Kvm *vm, const Value *args)
+const Value* Kvm::bytevectorLengthProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const String *s = static_cast<const String *>(car(args));
-    auto filename = s->value_;
-    std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(filename);
-    if (!out)
-    {
-        std::string msg;
-        msg.append("could not open file \"");
-        msg.append(filename);
-        msg.append("\"");
-        throw KatException(msg);
-    }
-    return vm->makeOutputPort(std::move(out));
+    return vm->makeFixnum(checkBytevector(argv[0])->size());
 }
 
-const Value* Kvm::closeOutputPortProc(Kvm *vm, const Value *args)
+const Value* Kvm::bytevectorRefProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const OutputPort *op = static_cast<const OutputPort *>(car(args));
-    op->output->close();
-    return vm->OK;
+    auto bytevector = checkBytevector(argv[0]);
+    return vm->makeFixnum(bytevector->bytes_[checkIndex(argv[1], bytevector)]);
 }
 
-const Value* Kvm::isOutputPortProc(Kvm *vm, const Value *args)
+// holds no pointers, so no barriers
+const Value* Kvm::bytevectorSetProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isOutputPort(car(args)) ? vm->TRUE: vm->FALSE;
+    auto bytevector = checkBytevector(argv[0]);
+    bytevector->bytes_[checkIndex(argv[1], bytevector)] = checkByte(argv[2]);
+    return vm->OK;
 }
 
-const Value* Kvm::isEofObjectProc(Kvm *vm, const Value *args)
+// (bytevector-copy bytevector [start [end]])
+const Value* Kvm::bytevectorCopyProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    return isEof(car(args)) ? vm->TRUE : vm->FALSE;
+    auto from = checkBytevector(argv[0]);
+    size_t start, end;
+    checkRange(argc, argv, 1, from->size_, start, end);
+    Bytevector *to = vm->gc_.allocBytevector(end - start);
+    bytes::copy(to->bytes_, from->bytes_ + start, end - start);
+    return to;
 }
 
-const Value* Kvm::errorProc(Kvm *vm, const Value *args)
+// (bytevector-copy! to at from [start [end]])
+const Value* Kvm::bytevectorCopyToProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    while (args != vm->NIL)
+    auto to = checkBytevector(argv[0]);
+    auto from = checkBytevector(argv[2]);
+    size_t at, start, end;
+    checkRange(argc, argv, 3, from->size_, start, end);
+    if (!IS_INT(argv[1]) || TK_INT(argv[1]) < 0 ||
+        static_cast<size_t>(TK_INT(argv[1])) > to->size_ ||
+        end - start > to->size_ - (at = TK_INT(argv[1])))
     {
-        vm->print(car(args), cerr);
-        cerr << " ";
-        args = cdr(args);
+        throw KatException("bytevector index out of range");
     }
-    cerr << "\nexiting...\n";
-    exit(-1);
+    bytes::copy(to->bytes_ + at, from->bytes_ + start, end - start);
+    return vm->OK;
 }
 
-const Value* Kvm::currentTimeMillisProc(Kvm *vm, const Value *args)
+const Value* Kvm::bytevectorAppendProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    using namespace std::chrono;
-    return vm->makeFixnum(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count());
+    size_t size = 0;
+    for (int i = 0; i != argc; ++i)
+        size += checkBytevector(argv[i])->size_;
+
+    Bytevector *result = vm->gc_.allocBytevector(size);
+    uint8_t *top = result->bytes_;
+    for (int i = 0; i != argc; ++i)
+    {
+        auto bytevector = static_cast<const Bytevector *>(argv[i]);
+        bytes::copy(top, bytevector->bytes_, bytevector->size_);
+        top += bytevector->size_;
+    }
+    return result;
 }
 
-const Value* Kvm::readProc(Kvm *vm, const Value *args)
+const Value* Kvm::isBytevectorEqualProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    const InputPort *ip = static_cast<const InputPort *>(args);
-    
-    std::istream &stream = args == vm->NIL ? std::cin : *ip->input;
-    auto result = vm->read(stream);
-    return result == nullptr ? vm->EOFOBJ : result;
+    auto a = checkBytevector(argv[0]);
+    auto b = checkBytevector(argv[1]);
+    return a->size_ == b->size_ && bytes::equal(a->bytes_, b->bytes_, a->size_) ? TRUE_VALUE : FALSE_VALUE;
 }
 
-const Value* Kvm::readCharProc(Kvm *vm, const Value *args)
+///////////////////////////////////////////////////////////////////////////////
+// the live entry of key, or nullptr
+HashTable::Entry* Kvm::hashTableEntry(HashTable *table, const Value *key)
 {
-    const InputPort *ip = static_cast<const InputPort *>(args);
-    std::istream &stream = args == vm->NIL ? std::cin : *ip->input;
+    // the nursery keys moved since they were hashed
+    if (table->youngKeys_ && table->epoch_ != gc_.epoch())
+    {
+        rehash(table, table->entries_.size());
+    }
+    if (table->entries_.empty()) return nullptr;
 
-    char c;
-    stream >> c;
-    return stream ? vm->EOFOBJ : vm->makeChar(c);
+    size_t mask = table->entries_.size() - 1;
+    for (size_t i = hashOf(key) & mask; ; i = (i + 1) & mask)
+    {
+        auto &entry = table->entries_[i];
+        if (entry.key == key) return &entry;
+        if (!entry.key && !entry.value) return nullptr;
+    }
 }
 
-const Value* Kvm::peekCharProc(Kvm *vm, const Value *args)
+void Kvm::hashTableSet(HashTable *table, const Value *key, const Value *value)
 {
-    const InputPort *ip = static_cast<const InputPort *>(args);
-    std::istream &stream = args == vm->NIL ? std::cin : *ip->input;
-    auto result = stream.peek();
-    return stream ? vm->makeChar(result) : vm->EOFOBJ;
-}
+    if (auto entry = hashTableEntry(table, key))
+    {
+        gc_.snapshotBarrier(entry->value);
+        entry->value = value;
+        gc_.writeBarrier(table, value);
+        return;
+    }
 
-const Value* Kvm::writeCharProc(Kvm *vm, const Value *args)
+    // at most half full, deleted entries included, to keep the probes short
+    if ((table->used_ + 1) * 2 > table->entries_.size())
+    {
+        size_t capacity = INITIAL_HASH_TABLE_SLOTS;
+        while (capacity < (table->size_ + 1) * 4)
+        {
+            capacity *= 2;
+        }
+        rehash(table, capacity);
+    }
+
+    // the key is not there, so the first deleted entry on the way will do
+    size_t mask = table->entries_.size() - 1;
+    size_t i = hashOf(key) & mask;
+    while (table->entries_[i].key)
+    {
+        i = (i + 1) & mask;
+    }
+    auto &entry = table->entries_[i];
+    if (!entry.value) ++table->used_;
+    entry.key = key;
+    entry.value = value;
+    ++table->size_;
+    if (isHashedByAddress(key) && gc_.isYoung(key))
+    {
+        if (!table->youngKeys_++) table->epoch_ = gc_.epoch();
+    }
+    gc_.writeBarrier(table, key);
+    gc_.writeBarrier(table, value);
+}
+
+// places the live entries again by their hashes now, dropping the deleted
+void Kvm::rehash(HashTable *table, size_t capacity)
 {
-    auto c = TK_CHR(car(args));
-    args = cdr(args);
-    
-    std::ostream &stream = args == vm->NIL ? cout : *static_cast<const OutputPort *>(car(args))->output;
-    stream << c;
-    stream.flush();
+    std::vector<HashTable::Entry> entries(capacity, HashTable::Entry{nullptr, nullptr});
+    entries.swap(table->entries_);
+
+    size_t mask = capacity - 1;
+    table->youngKeys_ = 0;
+    for (auto &&entry : entries)
+    {
+        if (!entry.key) continue;
+        size_t i = hashOf(entry.key) & mask;
+        while (table->entries_[i].key)
+        {
+            i = (i + 1) & mask;
+        }
+        table->entries_[i] = entry;
+        if (isHashedByAddress(entry.key) && gc_.isYoung(entry.key)) ++table->youngKeys_;
+    }
+    table->used_ = table->size_;
+    table->epoch_ = gc_.epoch();
+}
+
+const Value* Kvm::isHashTableP(Kvm *vm, int argc, const Value * const *argv)
+{
+    return isHashTable(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
+}
+
+const Value* Kvm::makeHashTableProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->gc_.allocValue(ValueType::HASH_TABLE);
+}
+
+// (hash-table-ref table key [thunk]) calls thunk when key is missing
+const Value* Kvm::hashTableRefProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    if (auto entry = vm->hashTableEntry(checkHashTable(argv[0]), argv[1]))
+    {
+        return entry->value;
+    }
+    if (argc == 2)
+    {
+        throw KatException("key not found in hash table");
+    }
+    return vm->callProcedure(argv[2], 0);
+}
+
+const Value* Kvm::hashTableRefDefaultProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto entry = vm->hashTableEntry(checkHashTable(argv[0]), argv[1]);
+    return entry ? entry->value : argv[2];
+}
+
+const Value* Kvm::hashTableSetProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    vm->hashTableSet(checkHashTable(argv[0]), argv[1], argv[2]);
     return vm->OK;
 }
 
-const Value* Kvm::displayProc(Kvm *vm, const Value *args)
+const Value* Kvm::hashTableDeleteProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    auto v = car(args);
-    args = cdr(args);
-    std::ostream &stream = args == vm->NIL ? cout : *static_cast<const OutputPort *>(car(args))->output;
+    auto table = checkHashTable(argv[0]);
+    if (auto entry = vm->hashTableEntry(table, argv[1]))
+    {
+        vm->gc_.snapshotBarrier(entry->key);
+        vm->gc_.snapshotBarrier(entry->value);
+        entry->key = nullptr;
+        entry->value = UNASSIGNED_VALUE;    // deleted, the probes go on past it
+        --table->size_;
+    }
+    return vm->OK;
+}
 
-    vm->displayValue(v, stream); 
+const Value* Kvm::hashTableContainsProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->hashTableEntry(checkHashTable(argv[0]), argv[1]) ? TRUE_VALUE : FALSE_VALUE;
+}
 
-    stream.flush();
+const Value* Kvm::hashTableCountProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->makeFixnum(checkHashTable(argv[0])->size());
+}
+
+// (hash-table-walk table procedure) calls procedure with every key and value
+const Value* Kvm::hashTableWalkProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto table = checkHashTable(argv[0]);
+    const Value *procedure = argv[1];
+    GcRoots<1> roots{vm->gc_, &procedure};
+
+    // copied onto the stack: the procedure or a collection may change the table
+    auto &stack = vm->stack_;
+    size_t base = stack.size();
+    for (auto &&entry : table->entries_)
+    {
+        if (!entry.key) continue;
+        stack.push_back(entry.key);
+        stack.push_back(entry.value);
+    }
+    size_t end = stack.size();
+    for (size_t i = base; i != end; i += 2)
+    {
+        auto key = stack[i];
+        auto value = stack[i + 1];
+        stack.push_back(key);
+        stack.push_back(value);
+        if (!vm->callProcedure(procedure, 2)) return nullptr;
+    }
+    stack.resize(base);
     return vm->OK;
 }
 
-const Value* Kvm::writeProc(Kvm *vm, const Value *args)
+// compares by contents, down the tails of lists without recursing
+bool Kvm::isEqual(const Value *a, const Value *b)
+{
+    while (a != b)
+    {
+        if (isCell(a) && isCell(b))
+        {
+            if (!isEqual(car(a), car(b))) return false;
+            a = cdr(a);
+            b = cdr(b);
+            continue;
+        }
+        if (!IS_HEAP(a) || !IS_HEAP(b) || a->type() != b->type())
+        {
+            return false;
+        }
+        switch (a->type())
+        {
+            case ValueType::STRING:
+                return static_cast<const String *>(a)->view() == static_cast<const String *>(b)->view();
+            case ValueType::BYTEVECTOR:
+            {
+                auto x = static_cast<const Bytevector *>(a);
+                auto y = static_cast<const Bytevector *>(b);
+                return x->size_ == y->size_ && bytes::equal(x->bytes_, y->bytes_, x->size_);
+            }
+            case ValueType::VECTOR:
+            {
+                auto x = static_cast<const Vector *>(a);
+                auto y = static_cast<const Vector *>(b);
+                if (x->size_ != y->size_) return false;
+                for (size_t i = 0; i != x->size_; ++i)
+                    if (!isEqual(x->elements_[i], y->elements_[i])) return false;
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+const Value* Kvm::isEqualProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->isEqual(argv[0], argv[1]) ? TRUE_VALUE : FALSE_VALUE;
+}
+
+const Value* Kvm::isEqProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto obj1 = argv[0];
+    auto obj2 = argv[1];
+
+    if (IS_INT(obj1) && IS_INT(obj2))
+    {
+        return TK_INT(obj1) == TK_INT(obj2) ? TRUE_VALUE : FALSE_VALUE;
+    } else if (IS_CHR(obj1) && IS_CHR(obj2))
+    {
+        return TK_CHR(obj1) == TK_CHR(obj2) ? TRUE_VALUE : FALSE_VALUE;
+    } else if (IS_INT(obj1) || IS_INT(obj2))
+    {
+        return FALSE_VALUE;
+    } else if (IS_CHR(obj1) || IS_CHR(obj2)) {
+        return FALSE_VALUE;
+    }
+
+    // the strings are mutable, so two of them are eq? only when they are one
+    return obj1 == obj2 ? TRUE_VALUE : FALSE_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::applyProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    cerr << "illegal state: The body of the apply primitive procedure should not execute." << endl;
+    exit(-1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::interactionEnvironmentProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->GLOBAL_ENV;
+}
+
+const Value* Kvm::nullEnvironmentProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->setupEnvironment();
+}
+
+const Value* Kvm::environmentProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return vm->makeEnvironment();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::evalProc(Kvm *vm, int argc, const Value * const *argv)
 {
-    auto head = car(args);
-    auto tail = cdr(args);
+    cerr << "illegal state: The body of the eval primitive procedure should not execute" << endl;
+    exit(-1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const Value* Kvm::loadProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    // argv points into the value stack, which `eval` below keeps using
+    const String *s = static_cast<const String *>(argv[0]);
+    std::string filename = s->data();
+
+    std::ifstream in(filename);
+
+    if (!in)
+    {
+        std::string msg("could not load file \"");
+        msg.append(filename);
+        msg.append("\"");
+        throw KatException(msg);
+    }
+
+    const Value *v = nullptr;
+    const Value *result = nullptr;
+
+    in.unsetf(std::ios_base::skipws);
+    while ((v = vm->read(in)) && in)
+    {
+        result = vm->eval(v, vm->GLOBAL_ENV);
+        if (!result) return nullptr;
+    }
+    return result;
+}
+
+const Value* Kvm::openInputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    const String *s = static_cast<const String *>(argv[0]);
+    auto filename = s->data();
     
-    if (tail == vm->NIL)
+    std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(filename, std::ios::binary);
+    if (!in)
     {
-        vm->print(head, std::cout);
-        std::cout.flush();
-    } else
+        std::string msg;
+        msg.append("could not open file \"");
+        msg.append(filename);
+        msg.append("\"");
+        throw KatException(msg);
+    }
+    return vm->makeInputPort(std::move(in));
+}
+
+const Value* Kvm::closeInputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    const InputPort *op = static_cast<const InputPort *>(argv[0]);
+    op->input->close();
+    return vm->OK;
+}
+
+const Value* Kvm::isInputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return isInputPort(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
+}
+
+const Value* Kvm::openOutputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    const String *s = static_cast<const String *>(argv[0]);
+    auto filename = s->data();
+    std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(filename, std::ios::binary);
+    if (!out)
+    {
+        std::string msg;
+        msg.append("could not open file \"");
+        msg.append(filename);
+        msg.append("\"");
+        throw KatException(msg);
+    }
+    return vm->makeOutputPort(std::move(out));
+}
+
+const Value* Kvm::closeOutputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    const OutputPort *op = static_cast<const OutputPort *>(argv[0]);
+    op->output->close();
+    return vm->OK;
+}
+
+const Value* Kvm::isOutputPortProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return isOutputPort(argv[0]) ? TRUE_VALUE: FALSE_VALUE;
+}
+
+const Value* Kvm::isEofObjectProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    return isEof(argv[0]) ? TRUE_VALUE : FALSE_VALUE;
+}
+
+const Value* Kvm::errorProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    for (int i = 0; i != argc; ++i)
+    {
+        vm->print(argv[i], cerr);
+        cerr << " ";
+    }
+    cerr << "\nexiting...\n";
+    exit(-1);
+}
+
+const Value* Kvm::currentTimeMillisProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    using namespace std::chrono;
+    return vm->makeFixnum(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count());
+}
+
+const Value* Kvm::readProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    std::istream &stream = argc == 0 ? std::cin : *static_cast<const InputPort *>(argv[0])->input;
+    auto result = vm->read(stream);
+    return result == nullptr ? EOF_VALUE : result;
+}
+
+const Value* Kvm::readCharProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    std::istream &stream = argc == 0 ? std::cin : *static_cast<const InputPort *>(argv[0])->input;
+
+    char c;
+    stream >> c;
+    return stream ? vm->makeChar(c) : EOF_VALUE;
+}
+
+// (read-bytevector k [port]), the buffer grows as the bytes arrive, so a
+// large k costs no more than what the port holds
+const Value* Kvm::readBytevectorProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    size_t size = checkBytevectorLength(argv[0]);
+    std::istream &stream = argc == 1 ? std::cin : *static_cast<const InputPort *>(argv[1])->input;
+
+    std::vector<char> buffer;
+    size_t count = 0;
+    while (count != size && stream)
     {
-        const OutputPort *op = static_cast<const OutputPort *>(car(tail));
-        vm->print(head, *op->output);
-        op->output->flush();
+        buffer.resize(std::min(size, std::max<size_t>(buffer.size() * 2, 4096)));
+        stream.read(buffer.data() + count, buffer.size() - count);
+        count += stream.gcount();
     }
+    if (count == 0 && size != 0)
+    {
+        return EOF_VALUE;
+    }
+    Bytevector *bytevector = vm->gc_.allocBytevector(count);
+    std::copy(buffer.begin(), buffer.begin() + count, bytevector->bytes_);
+    return bytevector;
+}
+
+// (read-bytevector! bytevector [port [start [end]]]) answers the bytes read
+const Value* Kvm::readBytevectorToProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto bytevector = checkBytevector(argv[0]);
+    std::istream &stream = argc == 1 ? std::cin : *static_cast<const InputPort *>(argv[1])->input;
+    size_t start, end;
+    checkRange(argc, argv, 2, bytevector->size_, start, end);
+
+    stream.read(reinterpret_cast<char *>(bytevector->bytes_ + start), end - start);
+    size_t count = stream.gcount();
+    if (count == 0 && end != start)
+    {
+        return EOF_VALUE;
+    }
+    return vm->makeFixnum(count);
+}
+
+const Value* Kvm::peekCharProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    std::istream &stream = argc == 0 ? std::cin : *static_cast<const InputPort *>(argv[0])->input;
+    auto result = stream.peek();
+    return stream ? vm->makeChar(result) : EOF_VALUE;
+}
+
+const Value* Kvm::writeCharProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto c = TK_CHR(argv[0]);
+    
+    std::ostream &stream = argc == 1 ? cout : *static_cast<const OutputPort *>(argv[1])->output;
+    stream << c;
+    stream.flush();
+    return vm->OK;
+}
+
+// (write-bytevector bytevector [port [start [end]]])
+const Value* Kvm::writeBytevectorProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    auto bytevector = checkBytevector(argv[0]);
+    std::ostream &stream = argc == 1 ? cout : *static_cast<const OutputPort *>(argv[1])->output;
+    size_t start, end;
+    checkRange(argc, argv, 2, bytevector->size_, start, end);
+
+    stream.write(reinterpret_cast<const char *>(bytevector->bytes_ + start), end - start);
+    stream.flush();
+    return vm->OK;
+}
+
+const Value* Kvm::displayProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    std::ostream &stream = argc == 1 ? cout : *static_cast<const OutputPort *>(argv[1])->output;
+
+    vm->displayValue(argv[0], stream); 
+
+    stream.flush();
+    return vm->OK;
+}
+
+const Value* Kvm::writeProc(Kvm *vm, int argc, const Value * const *argv)
+{
+    std::ostream &stream = argc == 1 ? cout : *static_cast<const OutputPort *>(argv[1])->output;
+
+    vm->print(argv[0], stream);
+    stream.flush();
     return vm->OK;
 }
 
@@ -823,14 +1492,15 @@ const Value* Kvm::writeProc(Kvm *vm, const Value *args)
 void Kvm::printCell(const Value *v, std::ostream &out)
 {
     print(car(v), out);
-    if (isCell(cdr(v)))
+    for (v = cdr(v); isCell(v); v = cdr(v))
     {
         out << " ";
-        printCell(cdr(v), out);
-    } else if (cdr(v) != NIL)
+        print(car(v), out);
+    }
+    if (v != NIL_VALUE)
     {
         out << " . ";
-        print(cdr(v), out);
+        print(v, out);
     }
 }
 
@@ -860,18 +1530,17 @@ void Kvm::print(const Value *v, std::ostream& out)
     }
     else
     {
-        switch (v->type())
+        switch (typeOf(v))
         {
             case ValueType::BOOLEAN:
-                out << (static_cast<const Boolean *>(v)->value_ ? "#t" : "#f");
+                out << (v == TRUE_VALUE ? "#t" : "#f");
                 break;
             case ValueType::STRING:
                 out << "\"";
                 {
-                    const char *c = static_cast<const String *>(v)->value_;
-                    while (*c)
+                    for (char c : static_cast<const String *>(v)->view())
                     {
-                        switch (*c)
+                        switch (c)
                         {
                             case '\n':
                                 out << "\\n";
@@ -883,10 +1552,9 @@ void Kvm::print(const Value *v, std::ostream& out)
                                 out << "\\\"";
                                 break;
                             default:
-                                out << *c;
+                                out << c;
                                 break;
                         }
-                        ++c;
                     }
                 }
                 out << "\"";
@@ -917,6 +1585,36 @@ void Kvm::print(const Value *v, std::ostream& out)
             case ValueType::EOF_OBJECT:
                 out << "#<eof>";
                 break;
+            case ValueType::ENVIRONMENT:
+                out << "#<environment>";
+                break;
+            case ValueType::HASH_TABLE:
+                out << "#<hash-table>";
+                break;
+            case ValueType::VECTOR:
+            {
+                auto vector = static_cast<const Vector *>(v);
+                out << "#(";
+                for (size_t i = 0; i != vector->size_; ++i)
+                {
+                    if (i) out << " ";
+                    print(vector->elements_[i], out);
+                }
+                out << ")";
+                break;
+            }
+            case ValueType::BYTEVECTOR:
+            {
+                auto bytevector = static_cast<const Bytevector *>(v);
+                out << "#u8(";
+                for (size_t i = 0; i != bytevector->size_; ++i)
+                {
+                    if (i) out << " ";
+                    out << static_cast<unsigned>(bytevector->bytes_[i]);
+                }
+                out << ")";
+                break;
+            }
             default:
                 cerr << "cannot write unknown type" << endl;
                 break;
@@ -924,94 +1622,83 @@ void Kvm::print(const Value *v, std::ostream& out)
     }
 }
 
-const Value* Kvm::firstFrame(const Value *env)
+const Value* Kvm::globalBinding(const Value *var, const Value *env)
 {
-    return car(env);
+    Environment *e = const_cast<Environment *>(static_cast<const Environment *>(env));
+    auto iter = e->bindings_.find(var);
+    if (iter != e->bindings_.end())
+    {
+        return iter->second;
+    }
+
+    Binding *binding = static_cast<Binding *>(gc_.allocValue(ValueType::BINDING));
+    binding->symbol_ = var;
+    binding->value_ = UNASSIGNED_VALUE;
+    e->bindings_[var] = binding;
+    return binding;
 }
 
-const Value* Kvm::lookupVariableValue(const Value *v, const Value *env)
+void Kvm::unboundVariable(const Value *var)
 {
-    auto cur_env = env;
-    while (cur_env != NIL)
-    {
-        auto frame = firstFrame(cur_env);
-        auto variables = frameVariables(frame);
-        auto values = frameValues(frame);
-        while (variables != NIL)
-        {
-            if (v == car(variables))
-            {
-                return car(values);
-            }
-            variables = cdr(variables);
-            values = cdr(values);
-        }
-        cur_env = enclosingEnv(cur_env);
-    }
     std::string msg;
     msg.append("unbound variable ");
-    msg.append(static_cast<const String *>(v)->value_);
+    msg.append(static_cast<const Symbol *>(var)->value_);
     throw KatException(msg);
 }
 
-const Value* Kvm::frameVariables(const Value *frame)
+const Frame* Kvm::lexicalFrame(size_t address, const Value *env)
 {
-    return car(frame);
-}
-
-const Value* Kvm::frameValues(const Value *frame)
-{
-    return cdr(frame);
+    const Frame *frame = static_cast<const Frame *>(env);
+    for (auto depth = LEXICAL_DEPTH(address); depth != 0; --depth)
+    {
+        frame = static_cast<const Frame *>(frame->parent_);
+    }
+    return frame;
 }
 
-void Kvm::addBindingToFrame(const Value *var, const Value *val, const Value *frame)
+const Value* Kvm::lookupLexicalValue(size_t address, const Value *env)
 {
-    const Value *result = nullptr;
-    gc_.pushLocalStackRoot(&result);
-    
-    result = makeCell(var, car(frame));
-    set_car(const_cast<Value *>(frame), result);
-    
-    result = makeCell(val, cdr(frame));
-    set_cdr(const_cast<Value *>(frame), result);
-    
-    gc_.popLocalStackRoot();
+    auto frame = lexicalFrame(address, env);
+    auto value = frame->slots_[LEXICAL_SLOT(address)];
+    if (value == UNASSIGNED_VALUE)
+    {
+        auto variables = static_cast<const Code *>(frame->code_)->variables_;
+        for (auto slot = LEXICAL_SLOT(address); slot != 0; --slot)
+            variables = cdr(variables);
+        unboundVariable(car(variables));
+    }
+    return value;
 }
 
-const Value* Kvm::makeFrame(const Value *vars, const Value *vals)
+void Kvm::setLexicalValue(size_t address, const Value *val, const Value *env)
 {
-    return makeCell(vars, vals);
+    auto frame = const_cast<Frame *>(lexicalFrame(address, env));
+    gc_.snapshotBarrier(frame->slots_[LEXICAL_SLOT(address)]);
+    storeField(frame->slots_[LEXICAL_SLOT(address)], val);
+    gc_.writeBarrier(frame, val);
 }
 
-const Value* Kvm::enclosingEnv(const Value *env)
+// the frame of a call: the arguments from the stack, then the unassigned
+// internal definitions
+const Value* Kvm::makeFrame(const Value *code, const Value *parent)
 {
-    return cdr(env);
-}
+    const Code *c = static_cast<const Code *>(code);
+    Frame *frame = gc_.allocFrame(c->numVariables_);
+    frame->parent_ = parent;
+    frame->code_ = code;
 
-/*
- * ENV ->   [ + . BASE_ENV ]
- *            |
- *      [vars . vals]
- */
-const Value* Kvm::extendEnvironment(const Value *vars, const Value *vals, const Value *base_env)
-{
-    const Value *result = nullptr;
-    gc_.pushLocalStackRoot(&result);
-    
-    result = makeFrame(vars, vals);
-    result = makeCell(result, base_env);
-    
-    gc_.popLocalStackRoot();
-    return result;
+    auto args = stack_.data() + stack_.size() - c->numParameters_;
+    size_t i = 0;
+    for (; i != c->numParameters_; ++i)
+        frame->slots_[i] = args[i];
+    for (; i != c->numVariables_; ++i)
+        frame->slots_[i] = UNASSIGNED_VALUE;
+    return frame;
 }
 
-/*
- *  EMPTY_ENV -> NIL
- *
- */
 const Value* Kvm::setupEnvironment()
 {
-    return extendEnvironment(NIL, NIL, EMPTY_ENV);
+    return gc_.allocValue(ValueType::ENVIRONMENT);
 }
 
 const Value* Kvm::assignmentVariable(const Value *v)
@@ -1024,227 +1711,612 @@ const Value* Kvm::assignmentValue(const Value* v)
     return car(cdr(cdr(v)));
 }
 
-void Kvm::setVariableValue(const Value *var, const Value *val, const Value *env)
+const Value * Kvm::defineVariable(const Value *var, const Value *val, const Value *env)
+{
+    auto binding = static_cast<const Binding *>(globalBinding(var, env));
+    gc_.snapshotBarrier(binding->value_);
+    storeField(const_cast<Binding *>(binding)->value_, val);
+    gc_.writeBarrier(binding, val);
+    return var;
+}
+
+const Value* Kvm::definitionVariable(const Value *v)
+{
+    if (isSymbol(cadr(v)))
+    {
+        return cadr(v);
+    } else
+    {
+        return car(cadr(v));
+    }
+}
+
+const Value* Kvm::eval(const Value *v, const Value *env)
+{
+    const Value *code = nullptr;
+    GcRoots<2> roots{gc_, &code, &env};
+
+    code = compileExpression(v, env);
+    return run(code, env);
+}
+
+const Value* Kvm::compileExpression(const Value *v, const Value *env)
+{
+    if (!isEnvironment(env))
+    {
+        throw KatException("expressions can only be evaluated in a top level environment");
+    }
+
+    Scope scope{env};
+    const Value *code = makeCode();
+    compile(v, const_cast<Code *>(static_cast<const Code *>(code)), &scope, true);
+    return code;
+}
+
+size_t Kvm::emit(Code *code, Opcode op, size_t arg)
+{
+    if (arg > MAX_OP_ARG)
+    {
+        throw KatException("procedure too large to compile");
+    }
+    code->instructions_.push_back(MK_OP(op, arg));
+    return code->instructions_.size() - 1;
+}
+
+void Kvm::patch(Code *code, size_t at, size_t target)
+{
+    auto op = OP_CODE(code->instructions_[at]);
+    code->instructions_[at] = MK_OP(op, target);
+}
+
+size_t Kvm::addConstant(Code *code, const Value *v)
 {
-    while (env != NIL)
+    code->constants_.push_back(v);
+    gc_.writeBarrier(code, v);
+    return code->constants_.size() - 1;
+}
+
+// `tail`: the value of v is the value of the procedure
+void Kvm::compile(const Value *v, Code *code, Scope *scope, bool tail)
+{
+    if (isSelfEvaluating(v) || isQuoted(v))
     {
-        auto frame = firstFrame(env);
-        auto variables = frameVariables(frame);
-        auto values = frameValues(frame);
-        while (variables != NIL)
+        emit(code, Opcode::CONST, addConstant(code, isQuoted(v) ? cadr(v) : v));
+    } else if (isVariable(v))
+    {
+        size_t address;
+        if (lexicalAddress(v, scope, address))
+            emit(code, Opcode::LOCAL_REF, address);
+        else
+            emit(code, Opcode::GLOBAL_REF, addConstant(code, globalBinding(v, scope->environment)));
+    } else if (isAssignment(v))
+    {
+        size_t address;
+        compile(assignmentValue(v), code, scope, false);
+        if (lexicalAddress(assignmentVariable(v), scope, address))
+            emit(code, Opcode::LOCAL_SET, address);
+        else
+            emit(code, Opcode::GLOBAL_SET, addConstant(code, globalBinding(assignmentVariable(v), scope->environment)));
+    } else if (isDefinition(v))
+    {
+        auto variable = definitionVariable(v);
+        size_t slot = 0;
+        if (!scope->isTopLevel())
         {
-            if (var == car(variables))
+            // scanOutDefines missed it, it is not at the top of the body
+            auto &variables = scope->variables;
+            slot = std::find(variables.begin(), variables.end(), variable) - variables.begin();
+            if (slot == variables.size())
             {
-                set_car(const_cast<Value *>(values), val);
-                return;
+                variables.push_back(variable);
             }
-            variables = cdr(variables);
-            values = cdr(values);
         }
-        env = enclosingEnv(env);
+        if (isSymbol(cadr(v)))
+            compile(caddr(v), code, scope, false);
+        else
+            compileLambda(cdadr(v), cddr(v), code, scope);
+
+        if (!scope->isTopLevel())
+            emit(code, Opcode::LOCAL_SET, MK_LEXICAL(0, slot));
+        else
+            emit(code, Opcode::GLOBAL_DEFINE, addConstant(code, globalBinding(variable, scope->environment)));
+    } else if (isIf(v))
+    {
+        compile(ifPredicate(v), code, scope, false);
+        auto toAlternative = emit(code, Opcode::JUMP_IF_FALSE);
+        compile(ifConsequent(v), code, scope, tail);
+        if (tail)
+        {
+            patch(code, toAlternative, code->instructions_.size());
+            compile(ifAlternative(v), code, scope, tail);
+        } else
+        {
+            auto toEnd = emit(code, Opcode::JUMP);
+            patch(code, toAlternative, code->instructions_.size());
+            compile(ifAlternative(v), code, scope, tail);
+            patch(code, toEnd, code->instructions_.size());
+        }
+        return;
+    } else if (isCond(v))
+    {
+        compileCond(condClauses(v), code, scope, tail);
+        return;
+    } else if (isLet(v))
+    {
+        compileLet(letBindings(v), letBody(v), code, scope, tail);
+        return;
+    } else if (isAnd(v) || isOr(v))
+    {
+        auto tests = isAnd(v) ? andTests(v) : orTests(v);
+        if (tests == NIL_VALUE)
+        {
+            compile(isAnd(v) ? TRUE_VALUE : FALSE_VALUE, code, scope, tail);
+            return;
+        }
+        auto op = isAnd(v) ? Opcode::JUMP_IF_FALSE_OR_POP : Opcode::JUMP_IF_TRUE_OR_POP;
+        std::vector<size_t> toEnd;
+        for (; cdr(tests) != NIL_VALUE; tests = cdr(tests))
+        {
+            compile(car(tests), code, scope, false);
+            toEnd.push_back(emit(code, op));
+        }
+        compile(car(tests), code, scope, tail);
+        for (auto at : toEnd)
+            patch(code, at, code->instructions_.size());
+    } else if (isLambda(v))
+    {
+        compileLambda(lambdaParameters(v), lambdaBody(v), code, scope);
+    } else if (isBegin(v))
+    {
+        compileSequence(beginActions(v), code, scope, tail);
+        return;
+    } else if (isApplication(v))
+    {
+        size_t argc = 0;
+        compile(procOperator(v), code, scope, false);
+        for (auto operands = procOperands(v); operands != NIL_VALUE; operands = cdr(operands), ++argc)
+            compile(car(operands), code, scope, false);
+        emit(code, tail ? Opcode::TAIL_CALL : Opcode::CALL, argc);
+        return;
+    } else
+    {
+        throw KatException("cannot evaluate unknown expression type");
+    }
+
+    if (tail)
+    {
+        emit(code, Opcode::RETURN);
     }
-    std::string msg;
-    msg.append("unbound variable ");
-    msg.append(static_cast<const String *>(var)->value_);
-    
-    throw KatException(msg);
 }
 
-const Value * Kvm::defineVariable(const Value *var, const Value *val, const Value *env)
+void Kvm::compileSequence(const Value *v, Code *code, Scope *scope, bool tail)
+{
+    if (v == NIL_VALUE)
+    {
+        throw KatException("empty sequence of expressions");
+    }
+    for (; cdr(v) != NIL_VALUE; v = cdr(v))
+    {
+        compile(car(v), code, scope, false);
+        emit(code, Opcode::POP);
+    }
+    compile(car(v), code, scope, tail);
+}
+
+void Kvm::compileLambda(const Value *parameters, const Value *body, Code *code, Scope *scope)
+{
+    Scope inner{scope};
+    for (; isCell(parameters); parameters = cdr(parameters))
+        inner.variables.push_back(car(parameters));
+    bool rest = parameters != NIL_VALUE;
+    if (rest)
+    {
+        inner.variables.push_back(parameters);
+    }
+    auto numParameters = inner.variables.size();
+    scanOutDefines(body, &inner);
+
+    const Value *lambda = makeCode();
+    Code *c = const_cast<Code *>(static_cast<const Code *>(lambda));
+    c->numParameters_ = numParameters;
+    c->rest_ = rest;
+    compileSequence(body, c, &inner, true);
+    nameVariables(c, inner);
+    emit(code, Opcode::CLOSURE, addConstant(code, lambda));
+}
+
+// the frame layout of code compiled in `scope`
+void Kvm::nameVariables(Code *code, const Scope &scope)
 {
-    auto frame = firstFrame(env);
-    auto variables = frameVariables(frame);
-    auto values = frameValues(frame);
-    while (variables != NIL)
+    if (scope.variables.size() > MAX_LEXICAL)
+    {
+        throw KatException("procedure has too many variables");
+    }
+    code->numVariables_ = scope.variables.size();
+    gc_.snapshotBarrier(code->variables_);
+    for (auto i = scope.variables.size(); i != 0; --i)
+        code->variables_ = makeCell(scope.variables[i - 1], code->variables_);
+    gc_.writeBarrier(code, code->variables_);
+}
+
+void Kvm::compileCond(const Value *clauses, Code *code, Scope *scope, bool tail)
+{
+    std::vector<size_t> toEnd;
+    for (; clauses != NIL_VALUE; clauses = cdr(clauses))
+    {
+        auto clause = car(clauses);
+        if (isCondElseClause(clause))
+        {
+            if (cdr(clauses) != NIL_VALUE)
+            {
+                throw KatException("else clause isn't last");
+            }
+            compileSequence(condActions(clause), code, scope, tail);
+            break;
+        }
+
+        compile(condPredicate(clause), code, scope, false);
+        if (condActions(clause) == NIL_VALUE)
+        {
+            // (cond (test) ...) has the value of the test
+            toEnd.push_back(emit(code, Opcode::JUMP_IF_TRUE_OR_POP));
+            continue;
+        }
+        auto toNext = emit(code, Opcode::JUMP_IF_FALSE);
+        compileSequence(condActions(clause), code, scope, tail);
+        if (!tail)
+        {
+            toEnd.push_back(emit(code, Opcode::JUMP));
+        }
+        patch(code, toNext, code->instructions_.size());
+    }
+    if (clauses == NIL_VALUE)
+    {
+        compile(FALSE_VALUE, code, scope, tail);
+    }
+
+    for (auto at : toEnd)
+        patch(code, at, code->instructions_.size());
+    if (tail && !toEnd.empty())
     {
-        if (var == car(variables))
-        {
-            set_car(const_cast<Value *>(values), val);
-            return var;
-        }
-        variables = cdr(variables);
-        values = cdr(values);
+        emit(code, Opcode::RETURN);
     }
-    addBindingToFrame(var, val, frame);
-    return var;
 }
 
-
-const Value* Kvm::evalAssignment(const Value *v, const Value *env)
+void Kvm::compileLet(const Value *bindings, const Value *body, Code *code, Scope *scope, bool tail)
 {
-    auto e = eval(assignmentValue(v), env);
-    if (!e) return nullptr;
-    setVariableValue(assignmentVariable(v), e, env);
-    return OK;
+    Scope inner{scope};
+    for (; bindings != NIL_VALUE; bindings = cdr(bindings))
+    {
+        compile(bindingArgument(car(bindings)), code, scope, false);
+        inner.variables.push_back(bindingParameter(car(bindings)));
+    }
+    auto numParameters = inner.variables.size();
+    scanOutDefines(body, &inner);
+
+    // the Code of a let only describes its frame, it has no instructions
+    const Value *frame = makeCode();
+    Code *c = const_cast<Code *>(static_cast<const Code *>(frame));
+    c->numParameters_ = numParameters;
+    emit(code, Opcode::ENTER, addConstant(code, frame));
+    compileSequence(body, code, &inner, tail);
+    if (!tail)
+    {
+        emit(code, Opcode::LEAVE);
+    }
+    nameVariables(c, inner);
 }
 
-const Value* Kvm::definitionVariable(const Value *v)
+// internal definitions get a slot in the frame of the procedure
+void Kvm::scanOutDefines(const Value *body, Scope *scope)
 {
-    if (isSymbol(cadr(v)))
-    {
-        return cadr(v);
-    } else
+    for (; body != NIL_VALUE; body = cdr(body))
     {
-        return car(cadr(v));
+        auto v = car(body);
+        if (isDefinition(v))
+        {
+            auto variable = definitionVariable(v);
+            auto &variables = scope->variables;
+            if (std::find(variables.begin(), variables.end(), variable) == variables.end())
+            {
+                variables.push_back(variable);
+            }
+        } else if (isBegin(v))
+        {
+            scanOutDefines(beginActions(v), scope);
+        }
     }
 }
 
-const Value* Kvm::definitionValue(const Value *v)
+bool Kvm::lexicalAddress(const Value *var, const Scope *scope, size_t &address)
 {
-    if (isSymbol(cadr(v)))
-    {
-        return caddr(v);
-    } else
+    for (size_t depth = 0; !scope->isTopLevel(); scope = scope->parent, ++depth)
     {
-        return makeLambda(cdadr(v), cddr(v));
+        auto &variables = scope->variables;
+        auto slot = std::find(variables.begin(), variables.end(), var) - variables.begin();
+        if (slot != (long)variables.size())
+        {
+            if (depth > MAX_LEXICAL || slot > MAX_LEXICAL)
+            {
+                throw KatException("procedure nested too deeply");
+            }
+            address = MK_LEXICAL(depth, slot);
+            return true;
+        }
     }
+    return false;
 }
 
-const Value* Kvm::evalDefinition(const Value *v, const Value *env)
+namespace
 {
-    const Value *result = nullptr;
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result);
-    result = definitionValue(v);
-    result = eval(result, env);
-    if (!result) return nullptr;
-    defineVariable(definitionVariable(v), result, env);
-    return OK;
+    // restores the value stack when a run is left, normally or not
+    struct StackUnwinder
+    {
+        StackUnwinder(std::vector<const Value *> &stack) : stack(stack), base(stack.size()) {}
+        ~StackUnwinder() { stack.resize(base); }
+
+        std::vector<const Value *> &stack;
+        size_t base;
+    };
 }
 
-const Value* Kvm::eval(const Value *v, const Value *env)
+/*
+ *  A call to a compound procedure saves the caller on the value stack
+ *
+ *      ... | code | env | pc | <callee temporaries>
+ *
+ *  and RETURN restores it. A RETURN that finds no saved caller above the
+ *  stack height at entry leaves `run`.
+ */
+const Value* Kvm::run(const Value *code, const Value *env)
 {
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&v);
-    guard.pushLocalStackRoot(&env);
-    
-tailcall: // wtf ?
-    if (isSelfEvaluating(v))
-    {
-        return v;
-    } else if (isVariable(v))
-    {
-        return lookupVariableValue(v, env);
-    } else if (isQuoted(v))
-    {
-        return cadr(v);
-    } else if (isAssignment(v))
-    {
-        return evalAssignment(v, env);
-    } else if (isDefinition(v))
-    {
-        return evalDefinition(v, env);
-    } else if (isIf(v))
-    {
-        v = eval(ifPredicate(v), env) != FALSE ? ifConsequent(v) : ifAlternative(v);
-        if (!v) return nullptr;
-        goto tailcall;
-    } else if (isCond(v))
-    {
-        v = condToIf(v);
-        goto tailcall;
-    } else if (isLet(v))
-    {
-        v = letToFuncApp(v);
-        goto tailcall;
-    } else if (isAnd(v))
+    const Value *procedure = nullptr;
+    const Value *arguments = nullptr;
+    GcRoots<4> roots{gc_, &code, &env, &procedure, &arguments};
+
+    StackUnwinder unwinder{stack_};
+    const size_t base = unwinder.base;
+    const uint32_t *instructions = static_cast<const Code *>(code)->instructions_.data();
+    const Value * const *constants = static_cast<const Code *>(code)->constants_.data();
+    const uint32_t *pc = instructions;
+
+    while (true)
     {
-        v = andTests(v);
-        if (v == NIL) return TRUE;
-        while (cdr(v) != NIL)
+        uint32_t ins = *pc++;
+        switch (OP_CODE(ins))
         {
-            auto result = eval(car(v), env);
-            if (!result) return nullptr;
-            else if (result == FALSE)
+            case Opcode::CONST:
+                stack_.push_back(constants[OP_ARG(ins)]);
+                break;
+            case Opcode::GLOBAL_REF:
             {
-                return result;
+                auto binding = static_cast<const Binding *>(constants[OP_ARG(ins)]);
+                if (binding->value_ == UNASSIGNED_VALUE) unboundVariable(binding->symbol_);
+                stack_.push_back(binding->value_);
+                break;
             }
-            v = cdr(v);
-        }
-        v = car(v);
-        goto tailcall;
-    } else if (isOr(v))
-    {
-        v = orTests(v);
-        if (v == NIL)
-        {
-            return FALSE;
-        }
-        while (cdr(v) != NIL)
-        {
-            auto result = eval(car(v), env);
-            if (!result) return nullptr;
-            else if (result != FALSE)
+            case Opcode::GLOBAL_SET:
+            {
+                auto binding = const_cast<Binding *>(static_cast<const Binding *>(constants[OP_ARG(ins)]));
+                if (binding->value_ == UNASSIGNED_VALUE) unboundVariable(binding->symbol_);
+                gc_.snapshotBarrier(binding->value_);
+                storeField(binding->value_, stack_.back());
+                gc_.writeBarrier(binding, binding->value_);
+                stack_.back() = OK;
+                break;
+            }
+            case Opcode::GLOBAL_DEFINE:
+            {
+                auto binding = const_cast<Binding *>(static_cast<const Binding *>(constants[OP_ARG(ins)]));
+                gc_.snapshotBarrier(binding->value_);
+                storeField(binding->value_, stack_.back());
+                gc_.writeBarrier(binding, binding->value_);
+                stack_.back() = OK;
+                break;
+            }
+            case Opcode::LOCAL_REF:
+                stack_.push_back(lookupLexicalValue(OP_ARG(ins), env));
+                break;
+            case Opcode::LOCAL_SET:
+                setLexicalValue(OP_ARG(ins), stack_.back(), env);
+                stack_.back() = OK;
+                break;
+            case Opcode::ENTER:
+            {
+                auto frame = constants[OP_ARG(ins)];
+                env = makeFrame(frame, env);
+                stack_.resize(stack_.size() - static_cast<const Code *>(frame)->numParameters_);
+                break;
+            }
+            case Opcode::LEAVE:
+                env = static_cast<const Frame *>(env)->parent_;
+                break;
+            case Opcode::POP:
+                stack_.pop_back();
+                break;
+            case Opcode::JUMP:
+                pc = instructions + OP_ARG(ins);
+                break;
+            case Opcode::JUMP_IF_FALSE:
+            {
+                auto test = stack_.back();
+                stack_.pop_back();
+                if (test == FALSE_VALUE) pc = instructions + OP_ARG(ins);
+                break;
+            }
+            case Opcode::JUMP_IF_FALSE_OR_POP:
+                if (stack_.back() == FALSE_VALUE) pc = instructions + OP_ARG(ins);
+                else stack_.pop_back();
+                break;
+            case Opcode::JUMP_IF_TRUE_OR_POP:
+                if (stack_.back() != FALSE_VALUE) pc = instructions + OP_ARG(ins);
+                else stack_.pop_back();
+                break;
+            case Opcode::CLOSURE:
+                stack_.push_back(makeCompoundProc(constants[OP_ARG(ins)], env));
+                break;
+            case Opcode::CALL:
+            case Opcode::TAIL_CALL:
+            {
+                size_t argc = OP_ARG(ins);
+                bool tail = OP_CODE(ins) == Opcode::TAIL_CALL;
+
+                // everything live is on the stack or in the guarded locals
+                gc_.safepoint();
+            apply:
+                procedure = stack_[stack_.size() - argc - 1];
+
+                // the tag tells a procedure, its header which kind
+                if (!isProcedure(procedure))
+                {
+                    throw KatException("unknown procedure type");
+                }
+                if (TK_PROC(procedure)->type() == ValueType::PRIM_PROC)
+                {
+                    auto primitive = static_cast<const PrimitiveProc *>(TK_PROC(procedure));
+                    if (static_cast<int>(argc) < primitive->minArgs_ ||
+                        (primitive->maxArgs_ != VARIADIC && static_cast<int>(argc) > primitive->maxArgs_))
+                    {
+                        throw KatException("wrong number of arguments");
+                    }
+
+                    auto func = primitive->func_;
+                    if (func == applyProc)
+                    {
+                        // (apply f a b '(c d)) continues as the call (f a b c d)
+                        auto first = stack_.size() - argc;
+                        arguments = stack_.back();
+                        stack_.pop_back();
+                        stack_.erase(stack_.begin() + first - 1);
+                        argc -= 2;
+                        for (; arguments != NIL_VALUE; arguments = cdr(arguments), ++argc)
+                            stack_.push_back(car(arguments));
+                        goto apply;
+                    } else if (func == evalProc)
+                    {
+                        // the evaluated expression runs as a call to a procedure
+                        // without arguments, to keep its tail calls proper
+                        auto expression = stack_[stack_.size() - 2];
+                        arguments = stack_.back();
+                        procedure = compileExpression(expression, arguments);
+                        stack_.resize(stack_.size() - argc - 1);
+                        if (!tail)
+                        {
+                            stack_.push_back(code);
+                            stack_.push_back(env);
+                            stack_.push_back(makeFixnum(pc - instructions));
+                        }
+                        env = arguments;
+                        code = procedure;
+                    } else
+                    {
+                        auto result = func(this, static_cast<int>(argc), stack_.data() + stack_.size() - argc);
+                        if (!result) return nullptr;
+                        stack_.resize(stack_.size() - argc - 1);
+                        stack_.push_back(result);
+                        if (tail) goto doReturn;
+                        break;
+                    }
+                } else
+                {
+                    const CompoundProc *cp = static_cast<const CompoundProc *>(TK_PROC(procedure));
+                    const Code *callee = static_cast<const Code *>(cp->code_);
+                    auto required = callee->numParameters_ - callee->rest_;
+                    if (argc < required || (!callee->rest_ && argc != required))
+                    {
+                        throw KatException("wrong number of arguments");
+                    }
+                    if (callee->rest_)
+                    {
+                        // only the extra arguments are consed up
+                        arguments = listOfValues(argc - required);
+                        stack_.resize(stack_.size() - (argc - required));
+                        stack_.push_back(arguments);
+                        argc = required + 1;
+                    }
+
+                    arguments = makeFrame(cp->code_, cp->env_);
+                    stack_.resize(stack_.size() - argc - 1);
+                    if (!tail)
+                    {
+                        stack_.push_back(code);
+                        stack_.push_back(env);
+                        stack_.push_back(makeFixnum(pc - instructions));
+                    }
+                    env = arguments;
+                    code = cp->code_;
+                }
+                instructions = static_cast<const Code *>(code)->instructions_.data();
+                constants = static_cast<const Code *>(code)->constants_.data();
+                pc = instructions;
+                break;
+            }
+            case Opcode::RETURN:
+            doReturn:
             {
-                return result;
+                auto result = stack_.back();
+                stack_.pop_back();
+                if (stack_.size() == base)
+                {
+                    return result;
+                }
+                auto offset = TK_INT(stack_.back());
+                stack_.pop_back();
+                env = stack_.back();
+                stack_.pop_back();
+                code = stack_.back();
+                stack_.back() = result;
+
+                instructions = static_cast<const Code *>(code)->instructions_.data();
+                constants = static_cast<const Code *>(code)->constants_.data();
+                pc = instructions + offset;
+                break;
             }
-            v = cdr(v);
         }
-        v = car(v);
-        goto tailcall;
-    } else if (isLambda(v))
-    {
-        return makeCompoundProc(lambdaParameters(v), lambdaBody(v), env);
-    } else if (isBegin(v))
+    }
+}
+
+// calls a procedure for a primitive, with the argc arguments on the stack
+const Value* Kvm::callProcedure(const Value *procedure, size_t argc)
+{
+    if (!isProcedure(procedure))
     {
-        v = beginActions(v);
-        while (cdr(v) != NIL)
-        {
-            if (!eval(car(v), env)) return nullptr;
-            v = cdr(v);
-        }
-        v = car(v);
-        goto tailcall;
-    } else if (isApplication(v))
+        throw KatException("unknown procedure type");
+    }
+    if (TK_PROC(procedure)->type() == ValueType::PRIM_PROC)
     {
-        const Value *procedure = nullptr;
-        const Value *arguments = nullptr;
-        GcGuard appGuard{gc_};
-        appGuard.pushLocalStackRoot(&procedure);
-        appGuard.pushLocalStackRoot(&arguments);
-        
-        procedure = eval(procOperator(v), env);
-        if (!procedure) return nullptr;
-        arguments = listOfValues(procOperands(v), env);
-
-        // handle eval specially for tailcall requirements
-        if (isPrimitiveProc(procedure) && static_cast<const PrimitiveProc *>(procedure)->func_ == evalProc)
+        auto primitive = static_cast<const PrimitiveProc *>(TK_PROC(procedure));
+        if (static_cast<int>(argc) < primitive->minArgs_ ||
+            (primitive->maxArgs_ != VARIADIC && static_cast<int>(argc) > primitive->maxArgs_))
         {
-            v = evalExpression(arguments);
-            env = evalEnvironment(arguments);
-            goto tailcall;
+            throw KatException("wrong number of arguments");
         }
-
-        // handle apply specially for tailcall requirement */
-        if (isPrimitiveProc(procedure) && static_cast<const PrimitiveProc *>(procedure)->func_ == applyProc)
+        if (primitive->func_ == applyProc || primitive->func_ == evalProc)
         {
-            procedure = applyOperator(arguments);
-            arguments = applyOperands(arguments);
+            throw KatException("apply and eval cannot be called from a primitive");
         }
+        auto result = primitive->func_(this, static_cast<int>(argc), stack_.data() + stack_.size() - argc);
+        stack_.resize(stack_.size() - argc);
+        return result;
+    }
 
-        if (isPrimitiveProc(procedure))
-        {
-            auto result = static_cast<const PrimitiveProc *>(procedure)->func_(this, arguments);
-            return result;
-        } else if (isCompoundProc(procedure))
-        {
-            const CompoundProc *cp = static_cast<const CompoundProc *>(procedure);
-
-            env = extendEnvironment(
-                    cp->parameters_,
-                    arguments,
-                    cp->env_);
-
-            v = makeBegin(cp->body_);
-            goto tailcall;
-        } else
-        {
-            throw KatException("unknown procedure type");
-        }
-    } else
+    const CompoundProc *cp = static_cast<const CompoundProc *>(TK_PROC(procedure));
+    const Code *callee = static_cast<const Code *>(cp->code_);
+    auto required = callee->numParameters_ - callee->rest_;
+    if (argc < required || (!callee->rest_ && argc != required))
     {
-        throw KatException("cannot evaluate unknown expression type");
+        throw KatException("wrong number of arguments");
+    }
+    if (callee->rest_)
+    {
+        auto rest = listOfValues(argc - required);
+        stack_.resize(stack_.size() - (argc - required));
+        stack_.push_back(rest);
+        argc = required + 1;
     }
+    auto frame = makeFrame(cp->code_, cp->env_);
+    stack_.resize(stack_.size() - argc);
+    return run(cp->code_, frame);
 }
 
 bool Kvm::isQuoted(const Value *v)
@@ -1271,7 +2343,8 @@ bool Kvm::isTagged(const Value *v, const Value *tag)
 
 bool Kvm::isSelfEvaluating(const Value *v)
 {
-    return isFixnum(v) || isCharacter(v) || isBoolean(v) || isString(v);
+    return isFixnum(v) || isCharacter(v) || isBoolean(v) || isString(v) || isVector(v) ||
+        isBytevector(v);
 }
 
 bool Kvm::isVariable(const Value *v)
@@ -1344,26 +2417,15 @@ const Value* Kvm::procOperands(const Value *v)
     return cdr(v);
 }
 
-const Value* Kvm::listOfValues(const Value *v, const Value *env)
+// the list of the argc values on top of the stack
+const Value* Kvm::listOfValues(size_t argc)
 {
-    if (v == NIL) // no operands
+    const Value *result = NIL_VALUE;
+    for (size_t i = 0; i != argc; ++i)
     {
-        return NIL;
+        result = makeCell(stack_[stack_.size() - 1 - i], result);
     }
-    
-    const Value *result1 = nullptr;
-    const Value *result2 = nullptr;
-    
-    GcGuard guard{gc_};
-    
-    guard.pushLocalStackRoot(&result1);
-    guard.pushLocalStackRoot(&result2);
-
-    result1 = eval(car(v), env);
-    if (!result1) return nullptr;
-    result2 = listOfValues(cdr(v), env);
-    result1 = makeCell(result1, result2);
-    return result1;
+    return result;
 }
 
 const Value* Kvm::ifPredicate(const Value *v)
@@ -1378,7 +2440,7 @@ const Value* Kvm::ifConsequent(const Value *v)
 
 const Value* Kvm::ifAlternative(const Value *v)
 {
-    if (cdddr(v) == NIL) return FALSE;
+    if (cdddr(v) == NIL_VALUE) return FALSE_VALUE;
     return cadddr(v);
 }
 ///////////////////////////////////////////////////////////////////////////////
@@ -1389,19 +2451,13 @@ const Value* Kvm::ifAlternative(const Value *v)
  *
  *     example clause: ((eq? 1 1) 4)
  *
- *     will be transformed to:   (if (eq? 1 1) 4 *)
- *                                               |
- *                                               +--------------+
- *                                                              |
- *     The rest of the clauses will also be transformed to if forms
- *
  *     example:
  *
  *     (cond (#f          1)
  *           ((eq? 'a 'a) 2)
  *           (else        3))
  *
- *     will be transformed to:
+ *     is compiled like
  *
  *     (if #f
  *          1
@@ -1409,51 +2465,13 @@ const Value* Kvm::ifAlternative(const Value *v)
  *              2
  *              3))
  *
+ *     without building the if forms (see Kvm::compileCond).
  */
 bool Kvm::isCond(const Value *v)
 {
     return isTagged(v, COND);
 }
 
-const Value* Kvm::condToIf(const Value *v)
-{
-    return expandClauses(condClauses(v));
-}
-
-const Value* Kvm::expandClauses(const Value *clauses)
-{
-    if (clauses == NIL)
-    {
-        return FALSE;
-    } else
-    {
-        auto first = car(clauses);
-        auto rest  = cdr(clauses);
-        if (isCondElseClause(first))
-        {
-            if (rest == NIL)
-            {
-                 return sequence(condActions(first));
-            } else
-            {
-                throw KatException("else clause isn't last");
-            }
-        } else
-        {
-            const Value *result1 = nullptr;
-            const Value *result2 = nullptr;
-            GcGuard guard{gc_};
-            guard.pushLocalStackRoot(&result1);
-            guard.pushLocalStackRoot(&result2);
-
-            result1 = sequence(condActions(first));
-            result2 = expandClauses(rest);
-            result1 = makeIf(condPredicate(first), result1, result2);
-            return result1;
-        }
-    }
-}
-
 const Value* Kvm::condClauses(const Value *v)
 {
     return cdr(v);
@@ -1475,6 +2493,15 @@ bool Kvm::isCondElseClause(const Value *clause)
  *          |
  *
  *
+ * example:
+ *
+ * (let ((x 1)
+ *       (y 2))
+ *   (+ x y))
+ *
+ * behaves like ((lambda (x y) (+ x y)) 1 2), but no procedure is made:
+ * the values are pushed and the body runs inline in a new frame (see
+ * Kvm::compileLet).
  */
 bool Kvm::isLet(const Value *v)
 {
@@ -1486,16 +2513,6 @@ const Value* Kvm::letBody(const Value *v)
     return cddr(v);
 }
 
-const Value* Kvm::letParameters(const Value *v)
-{
-    return bindingsParameters(letBindings(v));
-}
-
-const Value* Kvm::letArguments(const Value *v)
-{
-    return bindingsArguments(letBindings(v));
-}
-
 const Value* Kvm::bindingArgument(const Value *binding)
 {
     return cadr(binding);
@@ -1506,91 +2523,11 @@ const Value* Kvm::bindingParameter(const Value *binding)
     return car(binding);
 }
 
-const Value* Kvm::bindingsArguments(const Value *bindings)
-{
-    if (bindings == NIL) return NIL;
-
-    const Value *result = nullptr;
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result);
-    result = bindingsArguments(cdr(bindings));
-    result = makeCell(bindingArgument(car(bindings)), result);
-    return result;
-}
-
-const Value* Kvm::bindingsParameters(const Value *bindings)
-{
-    if (bindings == NIL) return NIL;
-
-    const Value *result = nullptr;
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result);
-    result = bindingsParameters(cdr(bindings));
-    result = makeCell(bindingParameter(car(bindings)), result);
-    return result;
-}
-
 const Value* Kvm::letBindings(const Value *v)
 {
     return cadr(v);
 }
 
-const Value* Kvm::applyOperator(const Value *arguments)
-{
-    return car(arguments);
-}
-
-const Value* Kvm::prepareApplyOperands(const Value *arguments)
-{
-    if (cdr(arguments) == NIL)
-    {
-        return car(arguments);
-    } else
-    {
-        const Value *result = nullptr;
-        GcGuard guard{gc_};
-        guard.pushLocalStackRoot(&result);
-        result = prepareApplyOperands(cdr(arguments));
-        result = makeCell(car(arguments), result);
-        return result;
-    }
-}
-
-const Value* Kvm::applyOperands(const Value *arguments)
-{
-    return prepareApplyOperands(cdr(arguments));
-}
-
-/*
- * example:
- *
- * (let ((x 1)
- *       (y 2))
- *   (+ x y))
- *
- * This must be transformed to:
- *
- * ((lambda (x y) (+ x y)) 1 2)
- *
- * let parameters: (x y)
- * let arguments : (1 2)
- * let body      : (+ x y)
- */
-const Value* Kvm::letToFuncApp(const Value *v)
-{
-    const Value *result1 = nullptr;
-    const Value *result2 = nullptr;
-    
-    GcGuard guard{gc_};
-    guard.pushLocalStackRoot(&result1);
-    guard.pushLocalStackRoot(&result2);
-    result1 = letParameters(v);
-    result1 = makeLambda(result1, letBody(v));
-    result2 = letArguments(v);
-    result1 = makeFuncApplication(result1, result2);
-    return result1;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 bool Kvm::isAnd(const Value *v)
 {
@@ -1612,20 +2549,6 @@ const Value* Kvm::orTests(const Value *v)
     return cdr(v);
 }
 ///////////////////////////////////////////////////////////////////////////////
-const Value* Kvm::sequence(const Value *v)
-{
-    if (v == NIL)
-    {
-        return v;
-    } else if (cdr(v) == NIL)
-    {
-        return car(v);
-    } else
-    {
-        return makeBegin(v);
-    }
-}
-
 const Value* Kvm::condActions(const Value *clause)
 {
     return cdr(clause);
@@ -1649,11 +2572,24 @@ const Value* Kvm::read(std::istream &in)
     {
         in >> c;
         if (c == 't')
-            return TRUE;
+            return TRUE_VALUE;
         else if (c == 'f')
-            return FALSE;
+            return FALSE_VALUE;
         else if (c == '\\')
             return readCharacter(in);
+        else if (c == '(')
+        {
+            const Value *elements = readPair(in);
+            if (!elements) return nullptr;
+            return listToVector(elements);
+        }
+        else if (c == 'u')
+        {
+            eatExpectedString(in, "8(");
+            const Value *elements = readPair(in);
+            if (!elements) return nullptr;
+            return listToBytevector(elements);
+        }
         else
         {
             throw KatException("unknown boolean literal");
@@ -1692,20 +2628,20 @@ const Value* Kvm::read(std::istream &in)
             }
             buffer.append(1, c);
         }
-        return makeString(buffer);
+        return internString(buffer);
 
     } else if (isInitial(c) || ((c == '+' || c == '-') && isDelimiter(in.peek()))) // FIXME: peek returns int
     {
-        string symbol;
+        token_.clear();
         while (isInitial(c) || isdigit(c) || c == '+' || c == '-')
         {
-            symbol.append(1, c);
+            token_.push_back(c);
             in >> c;
         }
         if (isDelimiter(c))
         {
             in.putback(c);
-            return makeSymbol(symbol);
+            return makeSymbol(token_);
         } else
         {
             cerr << "symbol not followed by delimiter. " <<
@@ -1716,12 +2652,9 @@ const Value* Kvm::read(std::istream &in)
         return readPair(in);
     } else if (c == '\'')
     {
-        const Value *result = nullptr;
-        GcGuard guard{gc_};
-        guard.pushLocalStackRoot(&result);
-        result = read(in);
+        const Value *result = read(in);
         if (!result) return nullptr;
-        result = makeCell(result, NIL);
+        result = makeCell(result, NIL_VALUE);
         result = makeCell(QUOTE, result);
         return result;
     } else
@@ -1735,48 +2668,53 @@ const Value* Kvm::read(std::istream &in)
     throw KatException("illegal read state");
 }
 
+// appends to the last cell, so long lists do not recurse
 const Value* Kvm::readPair(std::istream &in)
 {
-    eatWhitespace(in);
-
-    char c;
-    in >> c;
-    if (c == ')') return NIL;
-    in.putback(c);
-
+    const Value *head = NIL_VALUE;
     const Value *car_obj = nullptr;
-    const Value *cdr_obj = nullptr;
-    GcGuard readGuard{gc_};
-    readGuard.pushLocalStackRoot(&car_obj);
-    readGuard.pushLocalStackRoot(&cdr_obj);
+    Value *last = nullptr;
 
-    car_obj = read(in);
-    if (!car_obj) return nullptr;
-    eatWhitespace(in);
-    in >> c;
-    if (c == '.')  /* improper list */
+    char c;
+    for (;;)
     {
-        c = in.peek(); // FIXME: peek returns int
-        if (!isDelimiter(c))
-        {
-            throw KatException("dot not followed by delimiter");
-        }
-        cdr_obj = read(in);
-        if (!cdr_obj) return nullptr;
         eatWhitespace(in);
-        in >> c;
-        if (c != ')')
+        if (!(in >> c)) return nullptr;
+        if (c == ')') return head;
+
+        if (c == '.' && last)  /* improper list */
         {
-            throw KatException("where was the trailing paren?");
+            c = in.peek(); // FIXME: peek returns int
+            if (!isDelimiter(c))
+            {
+                throw KatException("dot not followed by delimiter");
+            }
+            car_obj = read(in);
+            if (!car_obj) return nullptr;
+            eatWhitespace(in);
+            in >> c;
+            if (c != ')')
+            {
+                throw KatException("where was the trailing paren?");
+            }
+            set_cdr(last, car_obj);
+            gc_.writeBarrier(last, car_obj);
+            return head;
         }
-        auto result = makeCell(car_obj, cdr_obj);
-        return result;
-    } else /* read list */
-    {
+
         in.putback(c);
-        cdr_obj = readPair(in);
-        auto result = makeCell(car_obj, cdr_obj);
-        return result;
+        car_obj = read(in);
+        if (!car_obj) return nullptr;
+        auto cell = const_cast<Value *>(makeCell(car_obj, NIL_VALUE));
+        if (last)
+        {
+            set_cdr(last, cell);
+            gc_.writeBarrier(last, cell);
+        } else
+        {
+            head = cell;
+        }
+        last = cell;
     }
 }
 
@@ -1819,15 +2757,6 @@ const Value* Kvm::readCharacter(std::istream &in)
 
 void Kvm::initialize()
 {
-    NIL   = makeNil();
-    GC_PROTECT(NIL);
-    
-    FALSE = makeBool(false);
-    GC_PROTECT(FALSE);
-    
-    TRUE  = makeBool(true);
-    GC_PROTECT(TRUE);
-    
     QUOTE = makeSymbol("quote");
     GC_PROTECT(QUOTE);
     
@@ -1864,16 +2793,16 @@ void Kvm::initialize()
     OR    = makeSymbol("or");
     GC_PROTECT(OR);
     
-    EOFOBJ= makeEofObject();
-    GC_PROTECT(EOFOBJ);
-    
-    EMPTY_ENV = NIL; // already protected
     GLOBAL_ENV= makeEnvironment();
     GC_PROTECT(GLOBAL_ENV);
 }
 
-Kvm::Kvm()
+Kvm::Kvm(long gcPauseBudget, unsigned int gcMarkThreads, bool gcConcurrent, bool gcStats)
+: gc_(INITIAL_GC_THRESHOLD, gcPauseBudget, gcMarkThreads, gcConcurrent, gcStats)
 {
+    gc_.pushRootStack(&stack_);
+    gc_.addWeakTable(&interned_strings);
+    gc_.setSymbolTable(&symbols);
     initialize();
 }
 
@@ -1902,6 +2831,11 @@ int Kvm::repl(std::istream &in, std::ostream &out)
         {
             out << e.what() << endl;
             in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        } catch (std::bad_alloc &)
+        {
+            // the pages of a large object could not be mapped
+            out << "out of memory" << endl;
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
         }
     }
     out << "Goodbye" << endl;
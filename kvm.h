@@ -11,12 +11,15 @@
 
 #include "kgc.h"
 #include "kvalue.h"
+#include "kcode.h"
+#include "ksymbol.h"
 
 class Value;
 
 class Kvm {
 public:
-    Kvm();
+    explicit Kvm(long gcPauseBudget = GC_PAUSE_BUDGET, unsigned int gcMarkThreads = MARK_THREADS,
+                 bool gcConcurrent = false, bool gcStats = false);
     int repl(std::istream &in, std::ostream &out);
 private:
     bool isQuoted(const Value *v);
@@ -37,61 +40,61 @@ private:
     const Value* lambdaBody(const Value *v);
     const Value* procOperator(const Value *v);
     const Value* procOperands(const Value *v);
-    const Value* listOfValues(const Value *v, const Value *env);
+    const Value* listOfValues(size_t argc);
     const Value* ifPredicate(const Value *v);
     const Value* ifConsequent(const Value *v);
     const Value* ifAlternative(const Value *v);
-    const Value* expandClauses(const Value *v);
     const Value* condClauses(const Value *v);
     const Value* condPredicate(const Value *clause);
-    const Value* sequence(const Value *v);
     const Value* condActions(const Value *v);
-    const Value* condToIf(const Value *v);
-    const Value* letToFuncApp(const Value *v);
     const Value* letBindings(const Value *v);
     const Value* letBody(const Value *v);
-    const Value* letParameters(const Value *v);
-    const Value* letArguments(const Value *v);
-    const Value* bindingsArguments(const Value *v);
-    const Value* bindingsParameters(const Value *v);
     const Value* bindingArgument(const Value *v);
     const Value* bindingParameter(const Value *v);
-    const Value* applyOperator(const Value *arguments);
-    const Value* prepareApplyOperands(const Value *arguments);
-    const Value* applyOperands(const Value *arguments);
 
 
     void print(const Value *v, std::ostream& out);
     const Value* eval(const Value *v, const Value *env);
-    const Value* evalAssignment(const Value *v, const Value *env);
+    const Value* run(const Value *code, const Value *env);
+    const Value* callProcedure(const Value *procedure, size_t argc);
+    const Value* compileExpression(const Value *v, const Value *env);
+    void compile(const Value *v, Code *code, Scope *scope, bool tail);
+    void compileSequence(const Value *v, Code *code, Scope *scope, bool tail);
+    void compileLambda(const Value *parameters, const Value *body, Code *code, Scope *scope);
+    void compileCond(const Value *clauses, Code *code, Scope *scope, bool tail);
+    void compileLet(const Value *bindings, const Value *body, Code *code, Scope *scope, bool tail);
+    void nameVariables(Code *code, const Scope &scope);
+    void scanOutDefines(const Value *body, Scope *scope);
+    bool lexicalAddress(const Value *var, const Scope *scope, size_t &address);
+    const Frame* lexicalFrame(size_t address, const Value *env);
+    const Value* lookupLexicalValue(size_t address, const Value *env);
+    void setLexicalValue(size_t address, const Value *val, const Value *env);
+    const Value* globalBinding(const Value *var, const Value *env);
+    void unboundVariable(const Value *var);
+    size_t emit(Code *code, Opcode op, size_t arg = 0);
+    void patch(Code *code, size_t at, size_t target);
+    size_t addConstant(Code *code, const Value *v);
     const Value* definitionVariable(const Value *v);
-    const Value* definitionValue(const Value *v);
-    const Value* evalDefinition(const Value *v, const Value *env);
     const Value* assignmentVariable(const Value *v);
     const Value* assignmentValue(const Value* v);
-    void setVariableValue(const Value *var, const Value *val, const Value *env);
     const Value* defineVariable(const Value *var, const Value *val, const Value *env);
     const Value* setupEnvironment();
-    const Value* extendEnvironment(const Value *vars, const Value *vals, const Value *base_env);
     const Value* read(std::istream &in);
-    const Value* firstFrame(const Value *env);
-    const Value* makeFrame(const Value *vars, const Value *vals);
-    const Value* frameVariables(const Value *frame);
-    const Value* frameValues(const Value *frame);
-    void addBindingToFrame(const Value *var, const Value *val, const Value *frame);
-    const Value* enclosingEnv(const Value *env);
-    const Value* lookupVariableValue(const Value *v, const Value *env);
+    const Value* makeFrame(const Value *code, const Value *parent);
+    const Value* makeVector(size_t size, const Value *fill);
+    const Value* listToVector(const Value *list);
+    const Value* listToBytevector(const Value *list);
+    bool isEqual(const Value *a, const Value *b);
+    HashTable::Entry* hashTableEntry(HashTable *table, const Value *key);
+    void hashTableSet(HashTable *table, const Value *key, const Value *value);
+    void rehash(HashTable *table, size_t capacity);
     void printCell(const Value *v, std::ostream &out);
     const Value* readPair(std::istream &in);
     const Value* readCharacter(std::istream &in);
-    const Value* makeFuncApplication(const Value *op, const Value *operands);
-    const Value* makeString(const std::string& str);
+    const Value* makeString(std::string_view str);
+    const Value* internString(const std::string& str);
     const Value* makeCell(const Value *first, const Value* second);
-    const Value* makeSymbol(const std::string& str);
-    const Value* makeBool(bool condition);
-    const Value* makeBegin(const Value *v);
-    const Value* makeEofObject();
-    const Value* makeIf(const Value *pred, const Value *conseq, const Value *alternate);
+    const Value* makeSymbol(std::string_view str);
     const Value* makeInputPort(std::unique_ptr<std::ifstream> input);
     const Value* makeOutputPort(std::unique_ptr<std::ofstream> output);
     bool isBegin(const Value *v);
@@ -101,84 +104,119 @@ private:
     // This implementation is silly.
     const Value* makeFixnum(long num);
     const Value* makeChar(char c);
-    const Value* makeNil();
-    const Value* makeProc(const Value* (*proc)(Kvm *vm, const Value *));
-    const Value* makeCompoundProc(const Value *parameters, const Value *body, const Value *env);
-    const Value* makeLambda(const Value *params, const Value *body);
+    const Value* makeProc(PrimitiveFunc proc, int minArgs, int maxArgs);
+    const Value* makeCompoundProc(const Value *code, const Value *env);
+    const Value* makeCode();
     const Value* andTests(const Value *v);
     const Value* orTests(const Value *v);
     const Value* makeEnvironment();
-    const Value* evalExpression(const Value *v);
-    const Value* evalEnvironment(const Value *arguments);
     void populateEnvironment(Value *env);
 
     void displayValue(const Value *v, std::ostream &out);
     void displayCell(const Value *v, std::ostream &out);
 
-    static const Value* isNullP(Kvm *vm, const Value *args);
-    static const Value* isBoolP(Kvm *vm, const Value *args);
-    static const Value* isSymbolP(Kvm *vm, const Value *args);
-    static const Value* isIntegerP(Kvm *vm, const Value *args);
-    static const Value* isCharP(Kvm *vm, const Value *args);
-    static const Value* isStringP(Kvm *vm, const Value *args);
-    static const Value* isPairP(Kvm *vm, const Value *args);
-    static const Value* isProcedureP(Kvm *vm, const Value *args);
-
-    static const Value* charToInteger(Kvm *vm, const Value *args);
-    static const Value* integerToChar(Kvm *vm, const Value *args);
-    static const Value* numberToString(Kvm *vm, const Value *args);
-    static const Value* stringToNumber(Kvm *vm, const Value *args);
-    static const Value* symbolToString(Kvm *vm, const Value *args);
-    static const Value* stringToSymbol(Kvm *vm, const Value *args);
-
-
-    static const Value* addProc(Kvm *vm, const Value *args);
-    static const Value* subProc(Kvm *vm, const Value *args);
-    static const Value* mulProc(Kvm *vm, const Value *args);
-    static const Value* quotientProc(Kvm *vm, const Value *args);
-    static const Value* remainderProc(Kvm *vm, const Value *args);
-    static const Value* isNumberEqualProc(Kvm *vm, const Value *args);
-    static const Value* isLessThanProc(Kvm *vm, const Value *args);
-    static const Value* isGreaterThanProc(Kvm *vm, const Value *args);
-    static const Value* consProc(Kvm *vm, const Value *args);
-    static const Value* carProc(Kvm *vm, const Value *args);
-    static const Value* cdrProc(Kvm *vm, const Value *args);
-    static const Value* setCarProc(Kvm *vm, const Value *args);
-    static const Value* setCdrProc(Kvm *vm, const Value *args);
-    static const Value* listProc(Kvm *vm, const Value *args);
-    static const Value* isEqProc(Kvm *vm, const Value *args);
-    static const Value* applyProc(Kvm *vm, const Value *args);
-    static const Value* interactionEnvironmentProc(Kvm *vm, const Value *args);
-    static const Value* nullEnvironmentProc(Kvm *vm, const Value *args);
-    static const Value* environmentProc(Kvm *vm, const Value *args);
-    static const Value* evalProc(Kvm *vm, const Value *args);
-    static const Value* loadProc(Kvm *vm, const Value *args);
-    static const Value* openInputPortProc(Kvm *vm, const Value *args);
-    static const Value* closeInputPortProc(Kvm *vm, const Value *args);
-    static const Value* isInputPortProc(Kvm *vm, const Value *args);
-
-    static const Value* openOutputPortProc(Kvm *vm, const Value *args);
-    static const Value* closeOutputPortProc(Kvm *vm, const Value *args);
-    static const Value* isOutputPortProc(Kvm *vm, const Value *args);
-
-    static const Value* isEofObjectProc(Kvm *vm, const Value *args);
-    static const Value* errorProc(Kvm *vm, const Value *args);
-    static const Value* currentTimeMillisProc(Kvm *vm, const Value *args);
-
-    static const Value* readProc(Kvm *vm, const Value *args);
-    static const Value* readCharProc(Kvm *vm, const Value *args);
-    static const Value* peekCharProc(Kvm *vm, const Value *args);
-    static const Value* writeCharProc(Kvm *vm, const Value *args);
-    static const Value* writeProc(Kvm *vm, const Value *args);
-    static const Value* displayProc(Kvm *vm, const Value *args);
-
-
-    std::unordered_map<std::string, const Value *> interned_strings;
-    std::unordered_map<std::string, const Value *> symbols;
-
-    const Value* NIL   ;
-    const Value* FALSE ;
-    const Value* TRUE  ;
+    static const Value* isNullP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isBoolP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isSymbolP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isIntegerP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isCharP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isStringP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isPairP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isProcedureP(Kvm *vm, int argc, const Value * const *argv);
+
+    static const Value* charToInteger(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* integerToChar(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* numberToString(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringToNumber(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* symbolToString(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringToSymbol(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* makeStringProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isStringEqualProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringLengthProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringRefProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringSetProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* substringProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* stringAppendProc(Kvm *vm, int argc, const Value * const *argv);
+
+
+    static const Value* addProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* subProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* mulProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* quotientProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* remainderProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isNumberEqualProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isLessThanProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isGreaterThanProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* consProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* carProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* cdrProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* setCarProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* setCdrProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* listProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isVectorP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* makeVectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorLengthProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorRefProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorSetProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorFillProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* vectorToListProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* listToVectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isBytevectorP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* makeBytevectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorLengthProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorRefProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorSetProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorCopyProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorCopyToProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* bytevectorAppendProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isBytevectorEqualProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isHashTableP(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* makeHashTableProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableRefProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableRefDefaultProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableSetProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableDeleteProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableContainsProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableCountProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* hashTableWalkProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isEqProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isEqualProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* applyProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* interactionEnvironmentProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* nullEnvironmentProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* environmentProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* evalProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* loadProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* openInputPortProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* closeInputPortProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isInputPortProc(Kvm *vm, int argc, const Value * const *argv);
+
+    static const Value* openOutputPortProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* closeOutputPortProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* isOutputPortProc(Kvm *vm, int argc, const Value * const *argv);
+
+    static const Value* isEofObjectProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* errorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* currentTimeMillisProc(Kvm *vm, int argc, const Value * const *argv);
+
+    static const Value* readProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* readCharProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* readBytevectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* readBytevectorToProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* writeBytevectorProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* peekCharProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* writeCharProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* writeProc(Kvm *vm, int argc, const Value * const *argv);
+    static const Value* displayProc(Kvm *vm, int argc, const Value * const *argv);
+
+
+    WeakTable interned_strings;     // the string literals
+    SymbolTable symbols;
+    std::string token_;             // the symbol being read
+    std::vector<const Value *> stack_;
+
     const Value* QUOTE ;
     const Value* DEFINE;
     const Value* SET   ;
@@ -191,12 +229,10 @@ private:
     const Value* LET   ;
     const Value* AND   ;
     const Value* OR    ;
-    const Value* EOFOBJ;
-    const Value* EMPTY_ENV ;
     const Value* GLOBAL_ENV;
     
     void initialize();
-    void addEnvProc(Value *env, const char *schemeName, const Value *(*proc)(Kvm *, const Value *));
+    void addEnvProc(Value *env, const char *schemeName, PrimitiveFunc proc, int minArgs, int maxArgs);
     
     Kgc gc_;
 
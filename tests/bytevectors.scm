@@ -0,0 +1,67 @@
+; fill and bytevector=? switch kernels at 16 and 32 bytes, and unroll at
+; 128: every size around those is filled and compared with a difference
+; at its first, middle and last byte. The errors are matched by
+; CMakeLists.txt
+(load "check.scm")
+
+(define (all-bytes? b i n byte)
+  (if (= i n) #t (if (= (bytevector-u8-ref b i) byte) (all-bytes? b (+ i 1) n byte) #f)))
+(define (differs-at? a i)
+  (let ((b (bytevector-copy a)))
+    (bytevector-u8-set! b i 8)
+    (if (bytevector=? a b) #f (not (bytevector=? b a)))))
+(define (kernel-ok? n)
+  (let ((a (make-bytevector n 7)))
+    (if (all-bytes? a 0 n 7)
+        (if (bytevector=? a (make-bytevector n 7))
+            (if (= n 0)
+                #t
+                (if (differs-at? a 0)
+                    (if (differs-at? a (quotient n 2)) (differs-at? a (- n 1)) #f)
+                    #f))
+            #f)
+        #f)))
+(define (sizes-ok? l) (if (null? l) #t (if (kernel-ok? (car l)) (sizes-ok? (cdr l)) #f)))
+(check (sizes-ok? '(0 1 15 16 17 31 32 33 47 63 64 65 127 128 129 160 255 256 257)))
+(check (not (bytevector=? (make-bytevector 16 0) (make-bytevector 17 0))))
+
+(define b (bytevector 1 2 3 4 5))
+(check (bytevector? b))
+(check (not (bytevector? #(1 2 3))))
+(check (= (bytevector-length b) 5))
+(check (bytevector=? (bytevector-copy b 1 3) #u8(2 3)))
+(check (bytevector=? (bytevector-append b #u8() #u8(6)) #u8(1 2 3 4 5 6)))
+(bytevector-copy! b 1 b 0 4)
+(check (bytevector=? b #u8(1 1 2 3 4)))
+(check (= (bytevector-u8-ref (make-bytevector 3) 2) 0))
+
+; a read cut short by the end of the file gives what was read
+(define port (open-input-port "check.scm"))
+(define chunk (read-bytevector 100000 port))
+(check (< (bytevector-length chunk) 1000))
+(check (= (bytevector-u8-ref chunk 0) 59))
+(check (eof-object? (read-bytevector 10 port)))
+(close-input-port port)
+; and the largest k allocates no more than the file holds
+(define port (open-input-port "check.scm"))
+(check (bytevector=? (read-bytevector 4294967295 port) chunk))
+(close-input-port port)
+
+; a large bytevector gets pages of its own, whose bytes count toward
+; collections: with many objects live, churning them still runs in the
+; memory CMakeLists.txt allows
+(define live (make-list 20000 '()))
+(define (churn-bytevectors n) (if (= n 0) 'done (begin (make-bytevector 100000 1) (churn-bytevectors (- n 1)))))
+(check (eq? (churn-bytevectors 10000) 'done))
+
+(bytevector-u8-ref b 5)
+(bytevector-u8-set! b -1 0)
+(bytevector-u8-set! b 0 256)
+(make-bytevector -1)
+(make-bytevector 100000000000000)
+(read-bytevector 100000000000000 (open-input-port "check.scm"))
+(bytevector-copy b 3 2)
+(bytevector-copy! b 4 b 0 2)
+(bytevector-length #(1 2))
+
+(write (if (= passed 14) 'all-passed 'FAILED))
@@ -0,0 +1,10 @@
+; the checks of a test script count what passed, and write FAILED for what
+; did not
+(define passed 0)
+(define (check ok) (if ok (set! passed (+ passed 1)) (write 'FAILED)))
+(define (not x) (if x #f #t))
+
+; the list (1 ... n) consed onto acc, and n of them dropped as garbage to
+; force collections
+(define (make-list n acc) (if (= n 0) acc (make-list (- n 1) (cons n acc))))
+(define (junk n) (if (= n 0) 'done (begin (make-list 100 '()) (junk (- n 1)))))
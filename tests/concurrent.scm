@@ -0,0 +1,36 @@
+; run with --gc-concurrent: the marker thread leaves hash tables and
+; environments to the vm, even when one is only the tail of a list, while
+; the vm grows them under it
+(load "check.scm")
+
+(define (tables n acc)
+  (if (= n 0) acc (tables (- n 1) (cons (cons n (make-hash-table)) acc))))
+(define held (tables 100 '()))
+(define env (cons 'x (interaction-environment)))
+
+(define (fill l k)
+  (if (null? l)
+      'done
+      (begin
+        (hash-table-set! (cdr (car l)) k (cons k k))
+        (fill (cdr l) k))))
+(define (grow k)
+  (if (= k 0)
+      'done
+      (begin
+        (fill held k)
+        (eval (list 'define (string->symbol (string-append "g" (number->string k))) k) (cdr env))
+        (grow (- k 1)))))
+(grow 1000)
+
+(define (all-full l)
+  (if (null? l)
+      #t
+      (if (= (hash-table-count (cdr (car l))) 1000)
+          (if (= (car (hash-table-ref (cdr (car l)) 123)) 123) (all-full (cdr l)) #f)
+          #f)))
+(check (all-full held))
+(check (= (eval 'g1000 (cdr env)) 1000))
+(check (= (eval 'g1 (interaction-environment)) 1))
+
+(write (if (= passed 3) 'all-passed 'FAILED))
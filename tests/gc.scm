@@ -0,0 +1,31 @@
+; old objects are written to while marks are in progress, with values only
+; they hold: whatever the mode, none of them may be swept
+(load "check.scm")
+
+(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))
+(define v (make-vector 64 '()))
+(define cells (make-list 64 '()))
+(define counter 0)
+
+(define (nth l i) (if (= i 0) l (nth (cdr l) (- i 1))))
+(define (mutate k)
+  (if (= k 0)
+      'done
+      (let ((i (remainder k 64)))
+        (vector-set! v i (make-list 10 '()))
+        (set-car! (nth cells i) (make-list 10 '()))
+        (set! counter (make-list 10 '()))
+        (junk 5)
+        (mutate (- k 1)))))
+(mutate 3000)
+
+(define (all-intact i)
+  (if (= i 64)
+      #t
+      (if (= (sum (vector-ref v i) 0) 55)
+          (if (= (sum (car (nth cells i)) 0) 55) (all-intact (+ i 1)) #f)
+          #f)))
+(check (all-intact 0))
+(check (= (sum counter 0) 55))
+
+(write (if (= passed 2) 'all-passed 'FAILED))
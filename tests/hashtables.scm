@@ -0,0 +1,43 @@
+; hash tables compare their keys with eq?, so a string key is found only by
+; the very string it was stored with
+(load "check.scm")
+
+(define t (make-hash-table))
+(define key (string-append "a" "b"))
+(hash-table-set! t key 1)
+(check (= (hash-table-ref t key) 1))
+(check (not (eq? key "ab")))
+(check (eq? (hash-table-ref/default t "ab" 'missing) 'missing))
+(check (not (hash-table-contains? t (string-append "a" "b"))))
+
+; eq? keys of every kind
+(hash-table-set! t 'sym 2)
+(hash-table-set! t 42 3)
+(hash-table-set! t #\c 4)
+(check (= (hash-table-ref t 'sym) 2))
+(check (= (hash-table-ref t 42) 3))
+(check (= (hash-table-ref t #\c) 4))
+(check (eq? (hash-table-ref t 'none (lambda () 'thunk)) 'thunk))
+(hash-table-delete! t 'sym)
+(check (not (hash-table-contains? t 'sym)))
+(check (= (hash-table-count t) 3))
+
+; pairs are hashed by address, and stay found after the collector moves them
+(define pairs (make-hash-table))
+(define (fill n acc)
+  (if (= n 0)
+      acc
+      (let ((k (cons n n)))
+        (hash-table-set! pairs k n)
+        (fill (- n 1) (cons k acc)))))
+(define keys (fill 5000 '()))
+(junk 3000)
+(define (all-found l)
+  (if (null? l) #t (if (= (hash-table-ref pairs (car l)) (car (car l))) (all-found (cdr l)) #f)))
+(check (all-found keys))
+
+(define sum 0)
+(hash-table-walk pairs (lambda (k v) (set! sum (+ sum v))))
+(check (= sum 12502500))
+
+(write (if (= passed 12) 'all-passed 'FAILED))
@@ -0,0 +1,34 @@
+; strings made apart are never eq?, whatever their contents
+(load "check.scm")
+
+(define a (make-string 2 #\a))
+(define b (make-string 2 #\a))
+(check (not (eq? a b)))
+(check (equal? a b))
+(check (string=? a b))
+(check (eq? a a))
+
+(string-set! a 0 #\b)
+(check (not (equal? a b)))
+(check (not (string=? a b)))
+(check (equal? a "ba"))
+
+(check (not (eq? (string-append "a" "b") "ab")))
+(check (equal? (string-append "a" "b") "ab"))
+(check (string=? (substring "xaby" 1 3) "ab" (string-append "a" "b")))
+
+; literals are shared, and cannot be changed
+(check (eq? "lit" "lit"))
+
+; equal? looks inside lists and vectors
+(check (equal? (list 1 (make-string 1 #\x) #(2 3)) (list 1 "x" (vector 2 3))))
+(check (not (equal? (list 1 2) (list 1 2 3))))
+
+; the chars of long strings count toward collections, not just their
+; slots: with many objects live, churning them still runs in the memory
+; CMakeLists.txt allows
+(define live (make-list 20000 '()))
+(define (churn-strings n) (if (= n 0) 'done (begin (make-string 100000 #\a) (churn-strings (- n 1)))))
+(check (eq? (churn-strings 10000) 'done))
+
+(write (if (= passed 14) 'all-passed 'FAILED))
@@ -0,0 +1,24 @@
+; symbols are interned weakly: the symbols nobody holds are dropped, and
+; their names compacted out of the arena, while the symbols held keep
+; their identity and their names
+(load "check.scm")
+
+(define kept (list 'alpha (string->symbol "beta") (string->symbol (string-append "gam" "ma"))))
+(define (garbage n)
+  (if (= n 0)
+      'done
+      (begin
+        (string->symbol (string-append "a-symbol-nobody-holds-" (number->string n)))
+        (garbage (- n 1)))))
+(garbage 40000)
+(junk 5000)
+
+(check (eq? (car kept) (string->symbol "alpha")))
+(check (eq? (car (cdr kept)) 'beta))
+(check (eq? (car (cdr (cdr kept))) 'gamma))
+(check (equal? (symbol->string (car (cdr (cdr kept)))) "gamma"))
+(check (eq? (string->symbol "a-symbol-nobody-holds-7") 'a-symbol-nobody-holds-7))
+(check (equal? (symbol->string 'a-symbol-nobody-holds-7) "a-symbol-nobody-holds-7"))
+(check (not (eq? 'alpha 'beta)))
+
+(write (if (= passed 7) 'all-passed 'FAILED))
@@ -0,0 +1,34 @@
+; pairs and procedures are told apart by the low bits of their pointers,
+; characters and constants by the bits of their values: every predicate
+; holds for its own kind only, also once the collector has moved them
+(load "check.scm")
+
+(define (kinds x)
+  (list (pair? x) (procedure? x) (integer? x) (char? x) (boolean? x) (null? x)
+        (string? x) (symbol? x) (vector? x)))
+(check (equal? (kinds (cons 1 2)) '(#t #f #f #f #f #f #f #f #f)))
+(check (equal? (kinds car) '(#f #t #f #f #f #f #f #f #f)))
+(check (equal? (kinds (lambda (x) x)) '(#f #t #f #f #f #f #f #f #f)))
+(check (equal? (kinds -7) '(#f #f #t #f #f #f #f #f #f)))
+(check (equal? (kinds #\a) '(#f #f #f #t #f #f #f #f #f)))
+(check (equal? (kinds #f) '(#f #f #f #f #t #f #f #f #f)))
+(check (equal? (kinds '()) '(#f #f #f #f #f #t #f #f #f)))
+(check (equal? (kinds "s") '(#f #f #f #f #f #f #t #f #f)))
+(check (equal? (kinds 'sym) '(#f #f #f #f #f #f #f #t #f)))
+(check (equal? (kinds #(1)) '(#f #f #f #f #f #f #f #f #t)))
+
+; young procedures and pairs, held by old ones, keep their tags when moved
+(define (adder n) (lambda (x) (+ x n)))
+(define held (make-vector 100 #f))
+(define (fill i) (if (= i 100) 'done (begin (vector-set! held i (cons (adder i) i)) (fill (+ i 1)))))
+(fill 0)
+(junk 3000)
+(define (all-add i)
+  (if (= i 100)
+      #t
+      (let ((p (vector-ref held i)))
+        (if (procedure? (car p)) (if (= ((car p) 1) (+ (cdr p) 1)) (all-add (+ i 1)) #f) #f))))
+(check (all-add 0))
+(check (= (apply (car (vector-ref held 5)) '(10)) 15))
+
+(write (if (= passed 12) 'all-passed 'FAILED))
@@ -0,0 +1,42 @@
+; vectors hold their elements inline; out of range indices are errors, and
+; the messages of the lines that raise them are matched by CMakeLists.txt
+(load "check.scm")
+
+(define v (make-vector 3 'x))
+(check (vector? v))
+(check (not (vector? '(1 2 3))))
+(check (= (vector-length v) 3))
+(check (eq? (vector-ref v 2) 'x))
+(check (eq? (vector-ref (make-vector 1) 0) #f))
+(vector-set! v 1 'y)
+(check (eq? (vector-ref v 1) 'y))
+(check (equal? (vector->list v) '(x y x)))
+(vector-fill! v 0)
+(check (equal? v #(0 0 0)))
+(check (equal? (list->vector '(1 2 3)) (vector 1 2 3)))
+(check (= (vector-length (vector)) 0))
+(check (= (vector-length #()) 0))
+
+; young elements stored into a vector survive the collections that move them
+(define big (make-vector 1000 '()))
+(define (fill i) (if (= i 1000) 'done (begin (vector-set! big i (make-list 3 '())) (fill (+ i 1)))))
+(fill 0)
+(junk 5000)
+(define (all-lists i) (if (= i 1000) #t (if (equal? (vector-ref big i) '(1 2 3)) (all-lists (+ i 1)) #f)))
+(check (all-lists 0))
+
+; a large vector gets pages of its own, whose bytes count toward
+; collections: with many objects live, churning them still runs in the
+; memory CMakeLists.txt allows
+(define live (make-list 20000 '()))
+(define (churn-vectors n) (if (= n 0) 'done (begin (make-vector 12500 0) (churn-vectors (- n 1)))))
+(check (eq? (churn-vectors 10000) 'done))
+
+(vector-ref v 3)
+(vector-ref v -1)
+(vector-set! v 10 0)
+(make-vector -1)
+(make-vector 2305843009213693952)
+(vector-ref '(1 2 3) 0)
+
+(write (if (= passed 13) 'all-passed 'FAILED))